@@ -0,0 +1,175 @@
+/*
+ * anim.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#include "anim.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hal.h"
+#include "ledmatrix.h"
+
+typedef struct
+{
+	// The keyframe being shown, copied from program memory. A duration of
+	// 0 marks a free slot.
+	AnimKeyframe frame;
+	// The keyframe after it, in program memory.
+	const AnimKeyframe *next;
+	// When the keyframe started being shown.
+	uint32_t frame_start;
+	// The centre pixel.
+	uint8_t row;
+	uint8_t col;
+	// Start order, so that the animation started last is shown on top.
+	uint16_t sequence;
+	// Whether the slot's pixels need drawing.
+	bool changed;
+} AnimSlot;
+
+static AnimSlot slots[ANIM_SLOTS];
+static uint16_t next_sequence;
+static void (*repaint_pixel)(uint8_t row, uint8_t col);
+
+void anim_reset(void (*repaint)(uint8_t row, uint8_t col))
+{
+	memset(slots, 0, sizeof(slots));
+	repaint_pixel = repaint;
+}
+
+bool anim_start(const AnimKeyframe *keyframes, uint8_t row, uint8_t col,
+	uint32_t now)
+{
+	for (uint8_t i = 0; i < ANIM_SLOTS; i++)
+	{
+		AnimSlot *slot = &slots[i];
+		if (slot->frame.duration != 0 || slot->changed)
+		{
+			continue;
+		}
+		memcpy_P(&slot->frame, keyframes, sizeof(slot->frame));
+		if (slot->frame.duration == 0)
+		{
+			// An empty animation.
+			slot->frame.mask = 0;
+			return true;
+		}
+		slot->next = keyframes + 1;
+		slot->frame_start = now;
+		slot->row = row;
+		slot->col = col;
+		slot->sequence = next_sequence++;
+		slot->changed = true;
+		return true;
+	}
+	return false;
+}
+
+// Whether a slot's keyframe covers a pixel.
+static bool covers(const AnimSlot *slot, uint8_t row, uint8_t col)
+{
+	int8_t delta_row = (int8_t)(row - slot->row);
+	int8_t delta_col = (int8_t)(col - slot->col);
+	if (delta_row < -1 || delta_row > 1 || delta_col < -1 || delta_col > 1)
+	{
+		return false;
+	}
+	return slot->frame.mask & ANIM_PIXEL(delta_row, delta_col);
+}
+
+// Draws a pixel in the colour of the newest animation covering it, or the
+// board if there is none.
+static void draw_pixel(uint8_t row, uint8_t col)
+{
+	const AnimSlot *top = NULL;
+	for (uint8_t i = 0; i < ANIM_SLOTS; i++)
+	{
+		const AnimSlot *slot = &slots[i];
+		if (slot->frame.duration == 0 || !covers(slot, row, col))
+		{
+			continue;
+		}
+		if (!top || (int16_t)(slot->sequence - top->sequence) > 0)
+		{
+			top = slot;
+		}
+	}
+	if (top)
+	{
+		ledmatrix_draw_pixel(row, col, top->frame.colour);
+	}
+	else if (repaint_pixel)
+	{
+		repaint_pixel(row, col);
+	}
+}
+
+// Draws the pixels of a slot's 3x3 square that are on the matrix.
+static void draw_slot(const AnimSlot *slot)
+{
+	for (int8_t delta_row = -1; delta_row <= 1; delta_row++)
+	{
+		int8_t row = slot->row + delta_row;
+		if (row < 0 || row >= MATRIX_NUM_ROWS)
+		{
+			continue;
+		}
+		for (int8_t delta_col = -1; delta_col <= 1; delta_col++)
+		{
+			int8_t col = slot->col + delta_col;
+			if (col < 0 || col >= MATRIX_NUM_COLUMNS)
+			{
+				continue;
+			}
+			draw_pixel(row, col);
+		}
+	}
+}
+
+void anim_update(uint32_t now)
+{
+	bool any_changed = false;
+	for (uint8_t i = 0; i < ANIM_SLOTS; i++)
+	{
+		AnimSlot *slot = &slots[i];
+		while (slot->frame.duration != 0 &&
+			now - slot->frame_start >= slot->frame.duration)
+		{
+			slot->frame_start += slot->frame.duration;
+			memcpy_P(&slot->frame, slot->next++, sizeof(slot->frame));
+			slot->changed = true;
+		}
+		if (slot->frame.duration == 0)
+		{
+			// Finished, so the next draw uncovers the slot's pixels.
+			slot->frame.mask = 0;
+		}
+		any_changed |= slot->changed;
+	}
+	if (!any_changed)
+	{
+		return;
+	}
+
+	// Only pixels that end up a different colour are sent.
+	ledmatrix_begin_frame();
+	for (uint8_t i = 0; i < ANIM_SLOTS; i++)
+	{
+		if (slots[i].changed)
+		{
+			draw_slot(&slots[i]);
+			slots[i].changed = false;
+		}
+	}
+	ledmatrix_commit_frame();
+}
+
+void anim_postpone(uint32_t ms)
+{
+	for (uint8_t i = 0; i < ANIM_SLOTS; i++)
+	{
+		slots[i].frame_start += ms;
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * anim.h
+ *
+ * Author: Jevi Waugh
+ *
+ * LED matrix animation scheduler. An animation is a list of keyframes in
+ * program memory, played on the 3x3 square of pixels around a centre
+ * pixel. Up to ANIM_SLOTS animations play at once; where they overlap, the
+ * one started last is shown, and pixels no animation covers show the board.
+ * Pixels outside the matrix are clipped.
+ */
+
+#ifndef ANIM_H_
+#define ANIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pixel_colour.h"
+
+// Number of animations that can play at the same time.
+#define ANIM_SLOTS 4
+
+// The bit of AnimKeyframe.mask for the pixel delta_row rows above and
+// delta_col columns right of the centre (each -1, 0 or 1).
+#define ANIM_PIXEL(delta_row, delta_col) \
+	(1U << (((delta_row) + 1) * 3 + (delta_col) + 1))
+
+// Every pixel of the 3x3 square.
+#define ANIM_ALL_PIXELS 0x01FFU
+
+typedef struct
+{
+	// How long the keyframe is shown for, in milliseconds. A keyframe with
+	// a duration of 0 ends the animation.
+	uint16_t duration;
+	// The pixels the keyframe covers (see ANIM_PIXEL).
+	uint16_t mask;
+	// The colour of the covered pixels.
+	PixelColour colour;
+} AnimKeyframe;
+
+/// <summary>
+/// Stops all animations, without repainting their pixels, and sets the
+/// function used to repaint a pixel from the board when no animation covers
+/// it any more.
+/// </summary>
+/// <param name="repaint">Draws the board at a pixel, with
+/// ledmatrix_draw_pixel().</param>
+void anim_reset(void (*repaint)(uint8_t row, uint8_t col));
+
+/// <summary>
+/// Starts an animation. Its first keyframe is drawn by the next
+/// anim_update().
+/// </summary>
+/// <param name="keyframes">The keyframes, in program memory.</param>
+/// <param name="row">The row of the centre pixel.</param>
+/// <param name="col">The column of the centre pixel.</param>
+/// <param name="now">The current time in milliseconds.</param>
+/// <returns>Whether a free slot was found for the animation.</returns>
+bool anim_start(const AnimKeyframe *keyframes, uint8_t row, uint8_t col,
+	uint32_t now);
+
+/// <summary>
+/// Moves each animation on to the keyframe due at the given time and draws
+/// the pixels whose colour changed, as one LED matrix frame.
+/// </summary>
+/// <param name="now">The current time in milliseconds.</param>
+void anim_update(uint32_t now);
+
+/// <summary>
+/// Delays every animation, e.g. by the time the game was paused for.
+/// </summary>
+/// <param name="ms">The delay in milliseconds.</param>
+void anim_postpone(uint32_t ms);
+
+#endif /* ANIM_H_ */
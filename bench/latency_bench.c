@@ -0,0 +1,477 @@
+/*
+ * latency_bench.c
+ *
+ * Author: Jevi Waugh
+ *
+ * Input-to-display latency benchmark. The game is built against the host
+ * HAL (see hal.h) together with this harness, which replays a trace of
+ * timestamped inputs - push button pin changes, UART bytes and joystick ADC
+ * values - and measures how long each input takes to reach the displays:
+ *
+ *   led      - until the last SPI byte queued while handling the input has
+ *              been shifted out to the LED matrix.
+ *   terminal - until the last terminal byte queued while handling the input
+ *              has left the UART.
+ *
+ * An input is "handled" from the moment the game consumes it (button_pushed()
+ * or serial_input_available() reports it, or the ADC channel is converted)
+ * until the main loop next calls button_pushed(). While the game sends its
+ * output in render frames (see render.h), it is handled until the end of
+ * the next frame that sends all of the terminal grid changes instead, so
+ * the frame's output is charged to the inputs that arrived since the last
+ * one. Inputs that produced no output on a display contribute no sample for
+ * that display.
+ *
+ * Build and run:
+ *
+ *   make latency_bench
+ *   LATENCY_TRACE=bench/traces/mixed.trace build/latency_bench
+ *
+ * or by hand:
+ *
+ *   cc -DHAL_HOST -O2 -o latency_bench *.c bench/latency_bench.c \
+ *       -Wl,--wrap=button_pushed,--wrap=serial_input_available \
+ *       -Wl,--wrap=spi_queue_byte,--wrap=render_begin,--wrap=render_end \
+ *       -Wl,--wrap=terminal_grid_flush
+ *   LATENCY_TRACE=bench/traces/mixed.trace ./latency_bench
+ *
+ * Trace lines are "<ms> uart <char|0xNN>", "<ms> button <pin mask>" or
+ * "<ms> adc <channel> <value>"; '#' starts a comment. A button event is
+ * measured when a pin goes high. The report is a tab separated table of
+ * p50/p99/max latency in microseconds per input source and display.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "../hal.h"
+#include "../buttons.h"
+#include "../terminalio.h"
+
+// How long to keep running after the last input, for output to drain.
+#define DRAIN_MS 3000
+
+#define MAX_EVENTS 1024
+#define CYCLES_PER_US (HAL_CPU_HZ / 1000000UL)
+
+typedef enum
+{
+	SRC_BUTTON,
+	SRC_UART,
+	SRC_JOYSTICK,
+	NUM_SOURCES
+} Source;
+
+static const char *const source_names[NUM_SOURCES] =
+{
+	"button", "uart", "joystick"
+};
+
+typedef enum
+{
+	EV_WAITING,  // Not injected yet.
+	EV_INJECTED, // Waiting for the game to consume it.
+	EV_HANDLING, // Consumed, output is being attributed to it.
+	EV_DRAINING, // Handled, waiting for its output to be sent.
+	EV_DONE
+} EventState;
+
+typedef struct
+{
+	uint32_t ms;
+	Source source;
+	uint8_t channel;
+	uint16_t value;
+	bool measured;
+	EventState state;
+	uint64_t injected;
+	uint32_t spi_seq;
+	uint64_t led_done;
+	uint32_t uart_seq;
+	uint64_t terminal_done;
+} Event;
+
+static Event events[MAX_EVENTS];
+static uint16_t num_events;
+static uint16_t next_event;
+static uint8_t button_pins;
+static uint32_t uart_queued_seq;
+static uint32_t uart_sent_seq;
+static uint32_t spi_queued_seq;
+static uint32_t spi_sent_seq;
+// Whether the game is sending its output in render frames.
+static bool rendering;
+
+// The game replaces stdout with its UART stream, so the report is written
+// to a duplicate of the original standard output.
+static FILE *report_out;
+
+ButtonState __real_button_pushed(void);
+bool __real_serial_input_available(void);
+void __real_spi_queue_byte(uint8_t byte);
+void __real_render_begin(uint32_t now);
+void __real_render_end(void);
+bool __real_terminal_grid_flush(uint16_t byte_budget);
+
+// Moves the oldest injected event from the given source (and ADC channel)
+// into the handling state.
+static void consume(Source source, uint8_t channel)
+{
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		Event *event = &events[i];
+		if (event->state == EV_INJECTED && event->source == source &&
+			(source != SRC_JOYSTICK || event->channel == channel))
+		{
+			event->state = EV_HANDLING;
+			return;
+		}
+	}
+}
+
+// Ends the handling window of every event being handled.
+static void end_handling(void)
+{
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		Event *event = &events[i];
+		if (event->state != EV_HANDLING)
+		{
+			continue;
+		}
+		if (event->uart_seq > uart_sent_seq ||
+			event->spi_seq > spi_sent_seq)
+		{
+			event->state = EV_DRAINING;
+		}
+		else
+		{
+			event->state = EV_DONE;
+		}
+	}
+}
+
+ButtonState __wrap_button_pushed(void)
+{
+	// Each main loop pass starts by checking the buttons. While rendering,
+	// the output comes later, in the next frame.
+	if (!rendering)
+	{
+		end_handling();
+	}
+	ButtonState result = __real_button_pushed();
+	if (result != NO_BUTTON_PUSHED)
+	{
+		consume(SRC_BUTTON, 0);
+	}
+	return result;
+}
+
+void __wrap_spi_queue_byte(uint8_t byte)
+{
+	spi_queued_seq++;
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		if (events[i].state == EV_HANDLING)
+		{
+			events[i].spi_seq = spi_queued_seq;
+		}
+	}
+	__real_spi_queue_byte(byte);
+}
+
+void __wrap_render_begin(uint32_t now)
+{
+	__real_render_begin(now);
+	rendering = true;
+}
+
+void __wrap_render_end(void)
+{
+	__real_render_end();
+	rendering = false;
+	end_handling();
+}
+
+bool __wrap_terminal_grid_flush(uint16_t byte_budget)
+{
+	// The grid is the last part of a render frame. A frame cut short by
+	// its byte budget leaves the rest to the next, so handling goes on.
+	bool complete = __real_terminal_grid_flush(byte_budget);
+	if (rendering && complete)
+	{
+		end_handling();
+	}
+	return complete;
+}
+
+bool __wrap_serial_input_available(void)
+{
+	bool result = __real_serial_input_available();
+	if (result)
+	{
+		consume(SRC_UART, 0);
+	}
+	return result;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void report_row(Source source, const char *path, uint64_t *samples,
+	uint16_t count, uint16_t dropped)
+{
+	qsort(samples, count, sizeof(samples[0]), compare_u64);
+	uint64_t p50 = 0, p99 = 0, max = 0;
+	if (count > 0)
+	{
+		// Nearest-rank percentiles.
+		p50 = samples[(count * 50 + 99) / 100 - 1];
+		p99 = samples[(count * 99 + 99) / 100 - 1];
+		max = samples[count - 1];
+	}
+	fprintf(report_out, "%s\t%s\t%u\t%u\t%llu\t%llu\t%llu\n",
+		source_names[source], path, count, dropped,
+		(unsigned long long)(p50 / CYCLES_PER_US),
+		(unsigned long long)(p99 / CYCLES_PER_US),
+		(unsigned long long)(max / CYCLES_PER_US));
+}
+
+static void report(void)
+{
+	static uint64_t led[MAX_EVENTS];
+	static uint64_t terminal[MAX_EVENTS];
+
+	fprintf(report_out,
+		"source\tdisplay\tsamples\tdropped\tp50_us\tp99_us\tmax_us\n");
+	for (uint8_t source = 0; source < NUM_SOURCES; source++)
+	{
+		uint16_t num_led = 0;
+		uint16_t num_terminal = 0;
+		uint16_t dropped = 0;
+		for (uint16_t i = 0; i < num_events; i++)
+		{
+			const Event *event = &events[i];
+			if (event->source != source || !event->measured)
+			{
+				continue;
+			}
+			if (event->state == EV_INJECTED)
+			{
+				dropped++;
+				continue;
+			}
+			if (event->led_done)
+			{
+				led[num_led++] = event->led_done - event->injected;
+			}
+			if (event->terminal_done)
+			{
+				terminal[num_terminal++] =
+					event->terminal_done - event->injected;
+			}
+		}
+		report_row(source, "led", led, num_led, dropped);
+		report_row(source, "terminal", terminal, num_terminal, dropped);
+	}
+}
+
+static void inject(Event *event)
+{
+	event->injected = hal_host_cycles();
+	event->state = EV_INJECTED;
+	switch (event->source)
+	{
+		case SRC_BUTTON:
+			// Only presses are queued by the game, releases are
+			// just replayed.
+			event->measured = (event->value & ~button_pins) != 0;
+			button_pins = event->value;
+			hal_host_set_buttons(button_pins);
+			break;
+		case SRC_UART:
+			event->measured = true;
+			hal_host_receive(event->value);
+			break;
+		case SRC_JOYSTICK:
+			event->measured = true;
+			hal_host_set_adc(event->channel, event->value);
+			break;
+		default:
+			break;
+	}
+	if (!event->measured)
+	{
+		event->state = EV_DONE;
+	}
+}
+
+static void on_tick(uint32_t ms)
+{
+	while (next_event < num_events && events[next_event].ms <= ms)
+	{
+		inject(&events[next_event++]);
+	}
+	if (next_event == num_events &&
+		(num_events == 0 || ms >= events[num_events - 1].ms + DRAIN_MS))
+	{
+		report();
+		fclose(report_out);
+		exit(0);
+	}
+}
+
+// Moves a draining event to done once all of its output has been sent.
+static void check_drained(Event *event)
+{
+	if (event->state == EV_DRAINING && event->uart_seq <= uart_sent_seq &&
+		event->spi_seq <= spi_sent_seq)
+	{
+		event->state = EV_DONE;
+	}
+}
+
+static void on_spi_sent(uint8_t byte)
+{
+	(void)byte;
+	spi_sent_seq++;
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		Event *event = &events[i];
+		if ((event->state == EV_HANDLING || event->state == EV_DRAINING) &&
+			event->spi_seq == spi_sent_seq)
+		{
+			event->led_done = hal_host_cycles();
+			check_drained(event);
+		}
+	}
+}
+
+static void on_uart_queued(char c)
+{
+	(void)c;
+	uart_queued_seq++;
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		if (events[i].state == EV_HANDLING)
+		{
+			events[i].uart_seq = uart_queued_seq;
+		}
+	}
+}
+
+static void on_uart_sent(uint8_t byte)
+{
+	(void)byte;
+	uart_sent_seq++;
+	for (uint16_t i = 0; i < num_events; i++)
+	{
+		Event *event = &events[i];
+		if ((event->state == EV_HANDLING || event->state == EV_DRAINING) &&
+			event->uart_seq == uart_sent_seq)
+		{
+			event->terminal_done = hal_host_cycles();
+			check_drained(event);
+		}
+	}
+}
+
+static void on_adc_read(uint8_t channel, uint16_t value)
+{
+	(void)value;
+	consume(SRC_JOYSTICK, channel);
+}
+
+static void load_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		exit(2);
+	}
+	char line[128];
+	unsigned line_no = 0;
+	while (fgets(line, sizeof(line), f) && num_events < MAX_EVENTS)
+	{
+		line_no++;
+		char *comment = strchr(line, '#');
+		if (comment)
+		{
+			*comment = '\0';
+		}
+		unsigned ms, channel, value;
+		char kind[16], arg[16];
+		int fields = sscanf(line, "%u %15s %15s %u", &ms, kind, arg,
+			&value);
+		if (fields <= 0)
+		{
+			continue;
+		}
+		Event *event = &events[num_events];
+		memset(event, 0, sizeof(*event));
+		event->ms = ms;
+		if (fields >= 3 && strcmp(kind, "uart") == 0)
+		{
+			event->source = SRC_UART;
+			event->value = (strncmp(arg, "0x", 2) == 0) ?
+				(uint16_t)strtoul(arg, NULL, 16) : (uint8_t)arg[0];
+		}
+		else if (fields >= 3 && strcmp(kind, "button") == 0)
+		{
+			event->source = SRC_BUTTON;
+			event->value = (uint16_t)strtoul(arg, NULL, 0) & 0x0F;
+		}
+		else if (fields == 4 && strcmp(kind, "adc") == 0 &&
+			sscanf(arg, "%u", &channel) == 1)
+		{
+			event->source = SRC_JOYSTICK;
+			event->channel = (uint8_t)channel;
+			event->value = (uint16_t)value;
+		}
+		else
+		{
+			fprintf(stderr, "%s:%u: bad trace line\n", path, line_no);
+			exit(2);
+		}
+		if (num_events > 0 && ms < events[num_events - 1].ms)
+		{
+			fprintf(stderr, "%s:%u: trace is not in time order\n",
+				path, line_no);
+			exit(2);
+		}
+		num_events++;
+	}
+	fclose(f);
+}
+
+static const HalHostHooks hooks =
+{
+	.tick = on_tick,
+	.spi_sent = on_spi_sent,
+	.uart_queued = on_uart_queued,
+	.uart_sent = on_uart_sent,
+	.adc_read = on_adc_read,
+	.own_input = true,
+	.discard_output = true,
+};
+
+__attribute__((constructor)) static void setup(void)
+{
+	const char *path = getenv("LATENCY_TRACE");
+	if (!path)
+	{
+		fprintf(stderr, "LATENCY_TRACE must name an input trace\n");
+		exit(2);
+	}
+	load_trace(path);
+	report_out = fdopen(dup(STDOUT_FILENO), "w");
+	hal_host_set_hooks(&hooks);
+}
@@ -0,0 +1,418 @@
+/*
+ * simavr_bench.c
+ *
+ * Author: Jevi Waugh
+ *
+ * Cycle-accurate benchmark of the game hot paths. The real ATmega324A ELF is
+ * run in simavr through a set of scripted scenarios (keystrokes sent to
+ * UART0 at fixed times) and every call of the probed functions and ISRs is
+ * timed in CPU cycles. A call starts when the program counter reaches the
+ * symbol's address and ends when the stack pointer rises above its value at
+ * entry (i.e. the return address has been popped).
+ *
+ * Build and run (needs avr-gcc, simavr and libelf installed), on the ELF
+ * the Makefile builds from the sources in the top-level directory:
+ *
+ *   make bench > now.tsv
+ *
+ * which is the same as
+ *
+ *   make build/sokoban.elf build/simavr_bench
+ *   build/simavr_bench build/sokoban.elf > now.tsv
+ *
+ * (The ELF checked in under "AVR Project/" is built from older copies of
+ * the sources and should not be used.) See the Makefile for comparing two
+ * commits.
+ *
+ * The output is a tab separated table, one row per scenario and probe:
+ *
+ *   scenario symbol calls total min max mean total_excl_isr
+ *
+ * total_excl_isr excludes cycles spent in interrupt handlers that fired
+ * during the call. Lines starting with '#' are per-scenario summaries. Diff
+ * the tables of two commits to spot cycle regressions. Static functions that
+ * the compiler inlined have no symbol and are reported with zero calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <elf.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_spi.h>
+
+#define MCU_NAME "atmega324a"
+#define MCU_FREQUENCY 8000000UL
+#define CYCLES_PER_MS (MCU_FREQUENCY / 1000)
+#define FLASH_SIZE 0x8000
+
+// Functions and interrupt vectors that are timed. Vector numbers are those
+// of the ATmega324A.
+static const struct
+{
+	const char *symbol;
+	const char *label;
+} probe_names[] =
+{
+	{ "move_player", "move_player" },
+	{ "paint_square", "paint_square" },
+	{ "is_game_over", "is_game_over" },
+	{ "flash_player", "flash_player" },
+	{ "flash_target_square", "flash_target_square" },
+	{ "initialise_game", "initialise_game" },
+	{ "display_terminal_title", "display_terminal_title" },
+	{ "ledmatrix_update_pixel", "ledmatrix_update_pixel" },
+	{ "move_terminal_cursor", "move_terminal_cursor" },
+	{ "set_display_attribute", "set_display_attribute" },
+	{ "__vector_5", "ISR(PCINT1)" },
+	{ "__vector_9", "ISR(TIMER2_COMPA)" },
+	{ "__vector_13", "ISR(TIMER1_COMPA)" },
+	{ "__vector_16", "ISR(TIMER0_COMPA)" },
+	{ "__vector_19", "ISR(SPI_STC)" },
+	{ "__vector_20", "ISR(USART0_RX)" },
+	{ "__vector_21", "ISR(USART0_UDRE)" },
+};
+
+#define NUM_PROBES (sizeof(probe_names) / sizeof(probe_names[0]))
+#define MAX_DEPTH 32
+
+typedef struct
+{
+	uint32_t addr;
+	bool found;
+	bool is_isr;
+	uint32_t calls;
+	uint64_t total;
+	uint64_t total_excl_isr;
+	uint64_t min;
+	uint64_t max;
+} Probe;
+
+typedef struct
+{
+	uint8_t probe;
+	uint16_t sp;
+	uint64_t start;
+	uint64_t isr_cycles;
+} Frame;
+
+// A keystroke sent at a time (milliseconds after reset).
+typedef struct
+{
+	uint32_t ms;
+	char key;
+} Step;
+
+typedef struct
+{
+	const char *name;
+	const Step *steps;
+	uint8_t num_steps;
+	uint32_t end_ms;
+} Scenario;
+
+// Level 1: the player starts at row 5, column 2. Four steps right and two
+// down pushes the box at row 3, column 6 onto the target below it.
+static const Step start_steps[] = { { 500, 's' } };
+static const Step walk_steps[] =
+{
+	{ 500, 's' }, { 3000, 'd' }, { 3300, 'd' }, { 3600, 'a' },
+	{ 3900, 'a' }, { 4200, 'w' }, { 4500, 's' }
+};
+static const Step wall_steps[] =
+{
+	{ 500, 's' }, { 3000, 'w' }, { 3300, 'w' }, { 3600, 'w' },
+	{ 3900, 'w' }
+};
+static const Step push_steps[] =
+{
+	{ 500, 's' }, { 3000, 'd' }, { 3300, 'd' }, { 3600, 'd' },
+	{ 3900, 'd' }, { 4200, 's' }, { 4500, 's' }
+};
+// Each 'i' prints the debug statistics below the game area, a line at a
+// time, so that each line starts with a full cursor move from an unknown
+// position.
+static const Step cursor_steps[] =
+{
+	{ 500, 's' }, { 3000, 'i' }, { 3500, 'i' }, { 4000, 'i' },
+	{ 4500, 'i' }
+};
+
+#define countof(x) (sizeof(x) / sizeof((x)[0]))
+
+static const Scenario scenarios[] =
+{
+	{ "boot", NULL, 0, 2000 },
+	{ "start_game", start_steps, countof(start_steps), 3000 },
+	{ "idle_flash", start_steps, countof(start_steps), 8000 },
+	{ "walk", walk_steps, countof(walk_steps), 6000 },
+	{ "wall_bump", wall_steps, countof(wall_steps), 6000 },
+	{ "push_on_target", push_steps, countof(push_steps), 6000 },
+	{ "cursor_move", cursor_steps, countof(cursor_steps), 5000 },
+};
+
+static Probe probes[NUM_PROBES];
+static uint8_t probe_at[FLASH_SIZE];
+static Frame frames[MAX_DEPTH];
+static uint8_t depth;
+static uint32_t uart_bytes;
+static uint32_t spi_bytes;
+
+// Looks the probed symbols up in the ELF symbol table. Unused interrupt
+// vectors all alias __bad_interrupt and are left unprobed.
+static void find_symbols(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *image = malloc(size);
+	if (!image || fread(image, 1, size, f) != (size_t)size)
+	{
+		fprintf(stderr, "%s: read failed\n", path);
+		exit(1);
+	}
+	fclose(f);
+
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)image;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+		ehdr->e_ident[EI_CLASS] != ELFCLASS32)
+	{
+		fprintf(stderr, "%s: not a 32-bit ELF file\n", path);
+		exit(1);
+	}
+	const Elf32_Shdr *shdr = (const Elf32_Shdr *)(image + ehdr->e_shoff);
+	uint32_t bad_interrupt = UINT32_MAX;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int s = 0; s < ehdr->e_shnum; s++)
+		{
+			if (shdr[s].sh_type != SHT_SYMTAB)
+			{
+				continue;
+			}
+			const Elf32_Sym *sym =
+				(const Elf32_Sym *)(image + shdr[s].sh_offset);
+			const char *names =
+				(const char *)(image + shdr[shdr[s].sh_link].sh_offset);
+			uint32_t count = shdr[s].sh_size / sizeof(Elf32_Sym);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				const char *name = names + sym[i].st_name;
+				if (pass == 0)
+				{
+					if (strcmp(name, "__bad_interrupt") == 0)
+					{
+						bad_interrupt = sym[i].st_value;
+					}
+					continue;
+				}
+				for (uint8_t p = 0; p < NUM_PROBES; p++)
+				{
+					if (strcmp(name, probe_names[p].symbol) == 0 &&
+						sym[i].st_value != bad_interrupt &&
+						sym[i].st_value < FLASH_SIZE)
+					{
+						probes[p].addr = sym[i].st_value;
+						probes[p].found = true;
+						probes[p].is_isr =
+							strncmp(name, "__vector_", 9) == 0;
+					}
+				}
+			}
+		}
+	}
+	free(image);
+}
+
+static void reset_probes(void)
+{
+	memset(probe_at, 0, sizeof(probe_at));
+	for (uint8_t p = 0; p < NUM_PROBES; p++)
+	{
+		Probe *probe = &probes[p];
+		probe->calls = 0;
+		probe->total = 0;
+		probe->total_excl_isr = 0;
+		probe->min = UINT64_MAX;
+		probe->max = 0;
+		if (probe->found)
+		{
+			probe_at[probe->addr] = p + 1;
+		}
+	}
+	depth = 0;
+	uart_bytes = 0;
+	spi_bytes = 0;
+}
+
+static uint16_t stack_pointer(avr_t *avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static void finish_frames(avr_t *avr)
+{
+	uint16_t sp = stack_pointer(avr);
+	while (depth > 0 && sp > frames[depth - 1].sp)
+	{
+		Frame *frame = &frames[--depth];
+		Probe *probe = &probes[frame->probe];
+		uint64_t cycles = avr->cycle - frame->start;
+		probe->calls++;
+		probe->total += cycles;
+		probe->total_excl_isr += cycles - frame->isr_cycles;
+		if (cycles < probe->min)
+		{
+			probe->min = cycles;
+		}
+		if (cycles > probe->max)
+		{
+			probe->max = cycles;
+		}
+		if (depth > 0)
+		{
+			// Interrupt time is charged to every enclosing frame.
+			frames[depth - 1].isr_cycles += probe->is_isr ?
+				cycles : frame->isr_cycles;
+		}
+	}
+}
+
+static void count_uart(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	(void)irq;
+	(void)value;
+	(void)param;
+	uart_bytes++;
+}
+
+static void count_spi(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	(void)irq;
+	(void)value;
+	(void)param;
+	spi_bytes++;
+}
+
+static void run_scenario(const char *path, const Scenario *scenario)
+{
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(path, &firmware) != 0)
+	{
+		fprintf(stderr, "%s: cannot load firmware\n", path);
+		exit(1);
+	}
+	avr_t *avr = avr_make_mcu_by_name(MCU_NAME);
+	if (!avr)
+	{
+		fprintf(stderr, "simavr does not support " MCU_NAME "\n");
+		exit(1);
+	}
+	avr_init(avr);
+	avr->frequency = MCU_FREQUENCY;
+	avr_load_firmware(avr, &firmware);
+
+	// Keep the game's terminal output off our stdout and count it.
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+		UART_IRQ_OUTPUT), count_uart, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0),
+		SPI_IRQ_OUTPUT), count_spi, NULL);
+	avr_irq_t *uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+		UART_IRQ_INPUT);
+
+	reset_probes();
+	uint8_t next_step = 0;
+	uint64_t end = (uint64_t)scenario->end_ms * CYCLES_PER_MS;
+	while (avr->cycle < end)
+	{
+		if (next_step < scenario->num_steps && avr->cycle >=
+			(uint64_t)scenario->steps[next_step].ms * CYCLES_PER_MS)
+		{
+			avr_raise_irq(uart_in,
+				(uint8_t)scenario->steps[next_step].key);
+			next_step++;
+		}
+
+		uint8_t p = avr->pc < FLASH_SIZE ? probe_at[avr->pc] : 0;
+		if (p && depth < MAX_DEPTH)
+		{
+			Frame *frame = &frames[depth++];
+			frame->probe = p - 1;
+			frame->sp = stack_pointer(avr);
+			frame->start = avr->cycle;
+			frame->isr_cycles = 0;
+		}
+
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+		{
+			fprintf(stderr, "%s: cpu stopped at pc 0x%04x\n",
+				scenario->name, avr->pc);
+			break;
+		}
+		if (depth > 0)
+		{
+			finish_frames(avr);
+		}
+	}
+
+	printf("# %s\tcycles=%llu\tuart_tx_bytes=%u\tspi_tx_bytes=%u\n",
+		scenario->name, (unsigned long long)avr->cycle, uart_bytes,
+		spi_bytes);
+	for (uint8_t i = 0; i < NUM_PROBES; i++)
+	{
+		const Probe *probe = &probes[i];
+		printf("%s\t%s\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+			scenario->name, probe_names[i].label, probe->calls,
+			(unsigned long long)probe->total,
+			(unsigned long long)(probe->calls ? probe->min : 0),
+			(unsigned long long)probe->max,
+			(unsigned long long)(probe->calls ?
+				probe->total / probe->calls : 0),
+			(unsigned long long)probe->total_excl_isr);
+	}
+	avr_terminate(avr);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s firmware.elf [scenario...]\n",
+			argv[0]);
+		return 2;
+	}
+	find_symbols(argv[1]);
+
+	printf("scenario\tsymbol\tcalls\ttotal\tmin\tmax\tmean\t"
+		"total_excl_isr\n");
+	for (uint8_t s = 0; s < countof(scenarios); s++)
+	{
+		bool wanted = argc == 2;
+		for (int a = 2; a < argc; a++)
+		{
+			wanted |= strcmp(argv[a], scenarios[s].name) == 0;
+		}
+		if (wanted)
+		{
+			run_scenario(argv[1], &scenarios[s]);
+		}
+	}
+	return 0;
+}
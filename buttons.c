@@ -7,8 +7,8 @@
 #include "buttons.h"
 #include <stdint.h>
 #include <stdbool.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
+#include "hal.h"
+#include "isrtrace.h"
 
 // Global variable to keep track of the last button state so that we
 // can detect changes when an interrupt fires. The lower 4 bits (0 to 3)
@@ -36,17 +36,9 @@ void init_buttons(void)
 	queue_length = 0;
 	last_button_state = 0;
 
-	// Enable the interrupt (see datasheet page 77).
-	PCICR |= (1 << PCIE1);
-	
-	// Make sure the interrupt flag is cleared (by writing a 
-	// 1 to it) (see datasheet page 78).
-	PCIFR |= (1 << PCIF1);
-	
-	// Choose which pins we're interested in by setting
-	// the relevant bits in the mask register (see datasheet page 78).
-	PCMSK1 |= (1 << PCINT8) | (1 << PCINT9) | (1 << PCINT10) |
-		(1 << PCINT11);
+	// Enable the interrupt and choose which pins we're interested in
+	// (see datasheet pages 77 and 78).
+	hal_buttons_init();
 }
 
 ButtonState button_pushed(void)
@@ -62,7 +54,7 @@ ButtonState button_pushed(void)
 		result = button_queue[0];
 
 		// Save whether interrupts were enabled and turn them off.
-		bool interrupts_were_enabled = bit_is_set(SREG, SREG_I);
+		bool interrupts_were_enabled = hal_interrupts_enabled();
 		cli();
 		
 		for (uint8_t i = 1; i < queue_length; i++)
@@ -83,7 +75,7 @@ ButtonState button_pushed(void)
 void clear_button_presses(void)
 {
 	// Save whether interrupts were enabled and turn them off.
-	bool interrupts_were_enabled = bit_is_set(SREG, SREG_I);
+	bool interrupts_were_enabled = hal_interrupts_enabled();
 	cli();
 	queue_length = 0;
 	last_button_state = 0;
@@ -97,9 +89,10 @@ void clear_button_presses(void)
 // Interrupt handler for a change on buttons.
 ISR(PCINT1_vect)
 {
+	ISR_TRACE_ENTER(ISR_TRACE_PCINT1);
 	// Get the current state of the buttons. We'll compare this with
 	// the last state to see what has changed.
-	uint8_t button_state = PINB & 0x0F;
+	uint8_t button_state = hal_buttons_read();
 
 	// Iterate over all the buttons and see which ones have changed.
 	// Any button pushes are added to the queue of button pushes (if
@@ -120,4 +113,5 @@ ISR(PCINT1_vect)
 	
 	// Remember this button state.
 	last_button_state = button_state;
+	ISR_TRACE_EXIT(ISR_TRACE_PCINT1);
 }
@@ -13,11 +13,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/io.h>
+#include "hal.h"
 #include "ledmatrix.h"
 #include "terminalio.h"
+#include "serialio.h"
+#include "status.h"
+#include "message.h"
+#include "timer0.h"
 #include "timer1.h"
 #include "timer2.h"
 
@@ -51,7 +53,6 @@ volatile int level = 1;
 volatile uint16_t freq;	// Hz
 volatile float dutycycle;	// %
 
-uint32_t last_target_area_flash_time;
 uint8_t new_object_location;
 uint8_t new_object_x = 0;
 uint8_t new_object_y = 0;
@@ -69,48 +70,72 @@ uint8_t old_player_moves[2];
 // A flag for keeping track of whether the player is currently visible.
 static bool player_visible;
 static bool target_visible;
+
+// The target squares of the level, as a mask of the target columns in each
+// row. Built by initialise_game(). Targets never move, so only whether a
+// box covers each one changes, and that is read from the board.
+static uint16_t target_cols[MATRIX_NUM_ROWS];
 bool box_pushed_on_target;
 #define NULL_WALL_MESSAGES 3
 
 
 // ========================== GAME LOGIC FUNCTIONS ===========================
 
+// How each combination of objects is shown: the LED matrix colour and the
+// terminal background colour. Combinations that cannot occur have no
+// background (TERM_RESET) and are not painted.
+typedef struct
+{
+	PixelColour pixel;
+	uint8_t background;
+} SquareStyle;
+
+static const SquareStyle square_styles[OBJECT_MASK + 1] PROGMEM =
+{
+	[ROOM]         = { COLOUR_BLACK,  BG_BLACK },
+	[WALL]         = { COLOUR_WALL,   BG_YELLOW },
+	[BOX]          = { COLOUR_BOX,    BG_MAGENTA },
+	[TARGET]       = { COLOUR_TARGET, BG_RED },
+	[BOX | TARGET] = { COLOUR_DONE,   BG_GREEN },
+};
+
+// Terminal position of the board's top left square. The board is drawn on
+// the terminal grid (see terminalio.h), whose row 0 is the board's top row.
+#define BOARD_TERM_ROW 13
+#define BOARD_TERM_COL 17
+
+// Looks up how the objects on a square are shown.
+static void get_square_style(uint8_t row, uint8_t col, SquareStyle *style)
+{
+	memcpy_P(style, &square_styles[board[row][col] & OBJECT_MASK],
+		sizeof(*style));
+}
+
+// Sets the colour of a board square on the terminal, to be sent by the next
+// terminal_grid_flush().
+static void paint_terminal_square(uint8_t row, uint8_t col,
+	DisplayParameter background)
+{
+	terminal_grid_set_cell(MATRIX_NUM_ROWS - 1 - row, col, background);
+}
+
 // This function paints a square based on the object(s) currently on it.
+// Nothing is sent until the LED matrix frame is committed and the terminal
+// grid is flushed.
 static void paint_square(uint8_t row, uint8_t col)
 {
-	DisplayParameter colour = BG_BLACK;
-	switch (board[row][col] & OBJECT_MASK)
+	SquareStyle style;
+	get_square_style(row, col, &style);
+	if (style.background == TERM_RESET)
 	{
-		case ROOM:
-			ledmatrix_update_pixel(row, col, COLOUR_BLACK);
-			colour = BG_BLACK;
-			break;
-		case WALL:
-			ledmatrix_update_pixel(row, col, COLOUR_WALL);
-			colour = BG_YELLOW;
-			break;
-		case BOX:
-			ledmatrix_update_pixel(row, col, COLOUR_BOX);
-			colour = BG_MAGENTA;
-			break;
-		case TARGET:
-			ledmatrix_update_pixel(row, col, COLOUR_TARGET);
-			colour = BG_RED;
-			break;
-		case BOX | TARGET:
-			ledmatrix_update_pixel(row, col, COLOUR_DONE);
-			colour = BG_GREEN;
-			break;
-		default:
-			return;
+		return;
 	}
-	move_terminal_cursor(12 + (MATRIX_NUM_ROWS - row),col+17);
-	set_display_attribute(colour);
-	printf_P(PSTR(" "));
-	set_display_attribute(TERM_RESET);
+	ledmatrix_draw_pixel(row, col, style.pixel);
+	paint_terminal_square(row, col, style.background);
 }
 void reset_animation_display(uint8_t y,  uint8_t x){
 	int i;
+	ledmatrix_begin_frame();
 	reset_cursor_position();
 	clear_to_end_of_line();
 	// printf_P(PSTR(" HEY THERE "));
@@ -125,20 +150,18 @@ void reset_animation_display(uint8_t y,  uint8_t x){
 		paint_square(target_area[i][0], target_area[i][1]);
 		
 	}
+	ledmatrix_commit_frame();
 	
 }
 void wall_message(){
-	int message_num = rand() % NULL_WALL_MESSAGES;
-	
-	const char *messages[3] = {
-		PSTR("YOU'VE HIT A WALL!"),
-		PSTR("THE WALL IS AN ENEMY! BEWARE"),
-		PSTR("AVOID THE WALLS!")
-	};
-
-	move_terminal_cursor(6,43);
-	clear_to_end_of_line();
-	printf_P(messages[message_num]); 
+	// Keep whichever wall message is shown, so that walking in to walls
+	// again sends nothing.
+	MessageId id = message_current();
+	if (id < MESSAGE_HIT_WALL || id > MESSAGE_AVOID_WALLS)
+	{
+		id = MESSAGE_HIT_WALL + rand() % NULL_WALL_MESSAGES;
+	}
+	message_show(id, get_current_time());
 }
 
 // This function initialises the global variables used to store the game
@@ -228,23 +251,27 @@ void initialise_game(int level)
 		}
 	}
 
-	// Draw the game board (map).
+	// Draw the game board (map), sent as one frame.
+	terminal_grid_init(BOARD_TERM_ROW, BOARD_TERM_COL);
+	ledmatrix_begin_frame();
 	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
 	{
 		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
 		{
 			paint_square(row, col);
-			
 		}
 	}
+	ledmatrix_commit_frame();
+	terminal_grid_flush(UINT16_MAX);
 	num_targets = 0;
 	steps_glob = 0;
 	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
 	{
+		target_cols[row] = 0;
 		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
 		{
 			if (board[row][col] & TARGET){
-				// optimise this with another loop instead
+				target_cols[row] |= 1U << col;
 				num_targets++;
 			}
 		}
@@ -259,79 +286,67 @@ void initialise_game(int level)
 void flash_player(void)
 {
 	player_visible = !player_visible;
+	ledmatrix_begin_frame();
 	if (player_visible)
 	{
 		// The player is visible, paint it with COLOUR_PLAYER.
-	move_terminal_cursor(12 + (MATRIX_NUM_ROWS - player_row),player_col+17);
-	set_display_attribute(BG_CYAN);
-	printf_P(PSTR(" "));
-	set_display_attribute(TERM_RESET);
-		ledmatrix_update_pixel(player_row, player_col, COLOUR_PLAYER);
+		paint_terminal_square(player_row, player_col, BG_CYAN);
+		ledmatrix_draw_pixel(player_row, player_col, COLOUR_PLAYER);
 	}
 	else
 	{
 		// The player is not visible, paint the underlying square.
 		paint_square(player_row, player_col);
 	}
+	ledmatrix_commit_frame();
 }
 
+// Flashes the targets not covered by a box or the player. Only the target
+// squares are visited, and only pixels that change are sent.
 void flash_target_square(){
 	
 	target_visible = !target_visible;
-	int i,j;
-	for (i=0; i< MATRIX_NUM_ROWS; i++){
-		for (j=0; j< MATRIX_NUM_COLUMNS; j++){
-			//DONT FORGET TO include BOX AS WELL
-			if (i == player_row && j == player_col)
+	PixelColour colour = target_visible ? COLOUR_TARGET : COLOUR_BLACK;
+	ledmatrix_begin_frame();
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		uint16_t cols = target_cols[row];
+		for (uint8_t col = 0; cols; col++, cols >>= 1)
+		{
+			if (!(cols & 1) || board[row][col] != TARGET)
 			{
 				continue;
 			}
-			if (board[i][j] == TARGET){
-				if(target_visible){
-					ledmatrix_update_pixel(i, j, COLOUR_TARGET);
-				}
-				else{
-					ledmatrix_update_pixel(i, j, COLOUR_BLACK);
-				}
+			if (row == player_row && col == player_col)
+			{
+				continue;
 			}
+			ledmatrix_draw_pixel(row, col, colour);
 		}
-
 	}
+	ledmatrix_commit_frame();
 }
-// not done
-void get_location_matrix(uint8_t y, uint8_t x){
-	//get the location of the player and the target from the matrix
-	//board[new_object_y][new_object_x] = (BOX | TARGET);
-	int num_area_squares = 9;
-	int i;
-	uint16_t target_area[9][2] = { {y+1,x-1}, {y+1,x}, {y+1,x+1},
-						   {y,x-1}, {y,x}, {y,x+1},
-						   {y-1,x-1}, {y-1,x}, {y-1,x+1}
-						};
-
-	for (i=0;i< num_area_squares;i++){
-		ledmatrix_update_pixel(target_area[i][0], target_area[i][1], COLOUR_LIGHT_ORANGE);
-		// paint_square(target_area[i][0], target_area[i][1]);
-		
+// Draws the board at a pixel of the LED matrix: the player if it is there
+// and visible, otherwise the square's objects, with a bare target following
+// the target flash.
+void paint_matrix_square(uint8_t row, uint8_t col)
+{
+	if (row == player_row && col == player_col && player_visible)
+	{
+		ledmatrix_draw_pixel(row, col, COLOUR_PLAYER);
+		return;
 	}
-
-}
-
-void get_location_matrix2(uint8_t y, uint8_t x){
-	//get the location of the player and the target from the matrix
-	//board[new_object_y][new_object_x] = (BOX | TARGET);
-	int num_area_squares = 9;
-	int i;
-	uint16_t target_area[9][2] = { {y+1,x-1}, {y+1,x}, {y+1,x+1},
-						   {y,x-1}, {y,x}, {y,x+1},
-						   {y-1,x-1}, {y-1,x}, {y-1,x+1}
-						};
-
-	for (i=0;i< num_area_squares;i++){
-		paint_square(target_area[i][0], target_area[i][1]);
-		
+	if (board[row][col] == TARGET && !target_visible)
+	{
+		ledmatrix_draw_pixel(row, col, COLOUR_BLACK);
+		return;
+	}
+	SquareStyle style;
+	get_square_style(row, col, &style);
+	if (style.background != TERM_RESET)
+	{
+		ledmatrix_draw_pixel(row, col, style.pixel);
 	}
-
 }
 
 void reset_cursor_position(){
@@ -354,16 +369,30 @@ void flash_terminal_player(uint8_t player_x, uint8_t player_y, uint8_t old_playe
 
 }
 
-// This function handles player movements.
+static bool try_move_player(int8_t delta_row, int8_t delta_col,
+	bool diagonal_move);
+
+// Moves the player, changing the squares the move repainted on the LED
+// matrix as one frame, so that the player and a pushed box are never shown
+// half moved. While the game is rendering (see render.h), the changes are
+// sent by the next render frame instead.
 bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 {
+	ledmatrix_begin_frame();
+	bool moved = try_move_player(delta_row, delta_col, diagonal_move);
+	ledmatrix_commit_frame();
+	return moved;
+}
+
+// This function handles player movements.
+static bool try_move_player(int8_t delta_row, int8_t delta_col,
+	bool diagonal_move)
+{
 	
 	
 	sei();
-	player_visible = true; 
 	target_visible = true;
 	
-	flash_player();   
 	// | 2. Calculate the new location of the player.                    |
 	// |      - You may find creating a function for this useful.        |
 
@@ -382,10 +411,16 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 	
 	box_pushed_on_target = false;
 	if (current_object == WALL){
+		// Nothing changes. The caller's flash_player() shows the player,
+		// which sends nothing if it is already shown, so walking in to a
+		// wall again and again sends nothing at all.
+		player_visible = false;
 		wall_message();
 		return false;
 	}
-	else if (current_object == BOX || current_object == (BOX | TARGET)){
+	player_visible = true; 
+	flash_player();   
+	if (current_object == BOX || current_object == (BOX | TARGET)){
 		// Everything else
 		// Check if the box can be moved
 		if (current_object == (BOX | TARGET)){
@@ -397,33 +432,23 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 				paint_square(new_object_y, new_object_x);  // Paint new box position
 				paint_square(new_player_y, new_player_x); 
 
-				// clear_terminal();
-				set_display_attribute(BG_BLACK);
-				move_terminal_cursor(6,44);
-				clear_to_end_of_line();
 				generate_music(PUSHING_BOX);
-				printf(PSTR("BOX MOVED FROM TARGET.\n"));
+				message_show(MESSAGE_BOX_OFF_TARGET, get_current_time());
 				
 			}
 			else if (new_object_location == WALL || new_object_location == BOX || new_object_location == (BOX | TARGET)){
 				switch (new_object_location)
 				{
 				case WALL:
-					move_terminal_cursor(6,44);
-					clear_to_end_of_line();
-					printf_P(PSTR("There's a wall there mate!"));
+					message_show(MESSAGE_BOX_BLOCKED_BY_WALL, get_current_time());
 					return false;
 					break;
 				case BOX:
-					move_terminal_cursor(6,44);
-					clear_to_end_of_line();
-					printf_P(PSTR("A box cannot be stacked on top of another box."));
+					message_show(MESSAGE_BOX_BLOCKED_BY_BOX, get_current_time());
 					return false;
 					break;
 				case (BOX | TARGET):
-					move_terminal_cursor(6,44);
-					clear_to_end_of_line();
-					printf_P(PSTR("Target already placed"));
+					message_show(MESSAGE_BOX_BLOCKED_BY_TARGET, get_current_time());
 					return false;
 					break;
 				}
@@ -436,31 +461,22 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 
 			paint_square(new_object_y, new_object_x);  // Paint new box position
             paint_square(new_player_y, new_player_x);   
-			move_terminal_cursor(6,44);
-			clear_to_end_of_line();
 			generate_music(PUSHING_BOX);
-			
-			printf("Box moved successfully.\n");
+			message_show(MESSAGE_BOX_MOVED, get_current_time());
 		}
 		else if (new_object_location == WALL || new_object_location == BOX || new_object_location == (BOX | TARGET)){
 			switch (new_object_location)
 			{
 			case WALL:
-				move_terminal_cursor(6,44);
-				clear_to_end_of_line();
-				printf_P(PSTR("There's a wall there mate!"));
+				message_show(MESSAGE_BOX_BLOCKED_BY_WALL, get_current_time());
 				return false;
 				break;
 			case BOX:
-				move_terminal_cursor(6,44);
-				clear_to_end_of_line();
-				printf_P(PSTR("A box cannot be stacked on top of another box."));
+				message_show(MESSAGE_BOX_BLOCKED_BY_BOX, get_current_time());
 				return false;
 				break;
 			case (BOX | TARGET):
-				move_terminal_cursor(6,44);
-				clear_to_end_of_line();
-				printf_P(PSTR("Target already placed"));
+				message_show(MESSAGE_BOX_BLOCKED_BY_TARGET, get_current_time());
 				return false;
 				break;
 			}
@@ -468,10 +484,8 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 		}
 		
 		else if (new_object_location == TARGET){
-			move_terminal_cursor(6,44);
-			clear_to_end_of_line();
 			target_met = true;
-			printf_P(PSTR("You've put the box in the target"));
+			message_show(MESSAGE_BOX_ON_TARGET, get_current_time());
 			// get_location_matrix(new_object_y, new_object_x);
 			board[new_object_y][new_object_x] = (BOX | TARGET);
 			board[new_player_y][new_player_x] = ROOM;
@@ -520,16 +534,6 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 	// move_terminal_cursor(6,4);
 	
 	
-	if (new_object_location != TARGET){
-		move_terminal_cursor(6,0);
-		clear_to_end_of_line();
-		// printf_P(PSTR("You've made a valid move!\n"));
-		
-		// player is just moving so 
-		// we'll do that for now and then do and test the other 2
-		// generate_music(PLAYER_MOVED);
-	}
-	
 	if (diagonal_move){
 		steps_glob = steps_glob + 2; //unbounded steps
 		number_to_display = (number_to_display + 2) % 100;
@@ -542,10 +546,9 @@ bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move)
 	
 	
 	
-	move_terminal_cursor(6,4);
-	printf_P(PSTR("Level: %d"), level);
-	move_terminal_cursor(6,15);
-	printf_P(PSTR("STEPS: %d"), steps_glob);
+	// Shown by the next status_flush().
+	status_set(STATUS_LEVEL, level);
+	status_set(STATUS_STEPS, steps_glob);
 	// move_terminal_cursor(0, 0);
 	// printf_P(PSTR("Joystick coordinates: x: %d y:%d     "), joy_x, joy_y);
 	// step should keep incrementing 
@@ -38,7 +38,6 @@ extern volatile int level;
 
 extern volatile uint16_t freq;	// Hz
 extern volatile float dutycycle;	// %
-extern uint32_t last_target_area_flash_time;
 extern uint8_t new_object_location;
 extern uint8_t new_object_x;
 extern uint8_t new_object_y;
@@ -56,8 +55,6 @@ void initialise_game(int level);
 void reset_animation_display(uint8_t new_object_x,  uint8_t new_object_y);
 void wall_message();
 void flash_target_square();
-void get_location_matrix(uint8_t y, uint8_t x);
-void get_location_matrix2(uint8_t y, uint8_t x);
 void undo_move(uint8_t move_made[]);
 /// <summary>
 /// Moves the player based on row and column deltas.
@@ -69,6 +66,14 @@ void reset_cursor_position();
 void flash_terminal_player(uint8_t player_x, uint8_t player_y, uint8_t old_player_x, uint8_t old_player_y);
 bool move_player(int8_t delta_row, int8_t delta_col, bool diagonal_move);
 
+/// <summary>
+/// Draws the board at a pixel of the LED matrix, as it would be shown with
+/// no animation playing. Used to repaint pixels when an animation ends.
+/// </summary>
+/// <param name="row">The row of the pixel.</param>
+/// <param name="col">The column of the pixel.</param>
+void paint_matrix_square(uint8_t row, uint8_t col);
+
 /// <summary>
 /// Detects whether the game is over (i.e., current level solved).
 /// </summary>
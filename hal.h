@@ -0,0 +1,439 @@
+/*
+ * hal.h
+ *
+ * Author: Jevi Waugh
+ *
+ * Thin hardware abstraction layer. Every access to an ATmega324A peripheral
+ * register made by the drivers (spi.c, serialio.c, timer0.c, timer1.c,
+ * timer2.c, buttons.c) and by the ADC/port code in project.c goes through
+ * the functions declared here. Two backends implement them:
+ *
+ *   hal_avr.c  - the real hardware (the default).
+ *   hal_host.c - a Linux simulation, selected by defining HAL_HOST. It has
+ *                a simulated 8MHz clock, a UART on stdin/stdout, an
+ *                in-memory LED matrix framebuffer and EEPROM.
+ *
+ * The game can be built and run natively with, for example:
+ *
+ *   cc -DHAL_HOST -O2 -o sokoban *.c
+ *   printf 'sdddw' | ./sokoban
+ *
+ * The host build exits a couple of simulated seconds after stdin reaches
+ * end of file. Set HAL_HOST_REALTIME in the environment to pace the
+ * simulated clock against the wall clock (useful for interactive play).
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// System clock rate in Hz.
+#define HAL_CPU_HZ 8000000UL
+
+#ifdef HAL_HOST
+
+#include <string.h>
+
+// Program memory does not exist on the host - everything lives in RAM.
+#define PROGMEM
+#define PSTR(s) (s)
+#define printf_P printf
+#define memcpy_P memcpy
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+// Interrupt handlers become plain functions, which the host backend calls
+// as simulated time passes.
+#define ISR(vector) void vector(void)
+#define sei() hal_host_enable_interrupts()
+#define cli() hal_host_disable_interrupts()
+
+void hal_host_enable_interrupts(void);
+void hal_host_disable_interrupts(void);
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#endif /* HAL_HOST */
+
+//
+// Interrupts.
+//
+
+/// <summary>
+/// Tests whether interrupts are globally enabled.
+/// </summary>
+/// <returns>Whether interrupts are enabled.</returns>
+bool hal_interrupts_enabled(void);
+
+/// <summary>
+/// Called from software busy-wait loops. Does nothing on the hardware. On the
+/// host it advances the simulated clock so that interrupts can fire.
+/// </summary>
+void hal_poll(void);
+
+//
+// SPI (LED matrix).
+//
+
+/// <summary>
+/// Configures SPI0 as a master and takes the slave select line low.
+/// </summary>
+/// <param name="clockdivider">The clock divider, should be one of 2, 4, 8,
+/// 16, 32, 64, 128. Invalid values default to the slowest speed.</param>
+void hal_spi_init(uint8_t clockdivider);
+
+/// <summary>
+/// Enables the serial transfer complete interrupt (SPI_STC_vect).
+/// </summary>
+void hal_spi_enable_interrupt(void);
+
+/// <summary>
+/// Starts sending an SPI byte and returns without waiting for the transfer.
+/// </summary>
+/// <param name="byte">The byte to send.</param>
+void hal_spi_write(uint8_t byte);
+
+/// <summary>
+/// Busy waits until the transfer in progress is done. Only valid with
+/// interrupts disabled, since the interrupt handler would otherwise consume
+/// the transfer complete flag.
+/// </summary>
+/// <returns>The byte received.</returns>
+uint8_t hal_spi_wait(void);
+
+//
+// UART0 (serial terminal).
+//
+
+/// <summary>
+/// Sets the baud rate and enables the transmitter, the receiver and the
+/// receive complete interrupt.
+/// </summary>
+/// <param name="baudrate">The baud rate (e.g., 19200).</param>
+void hal_uart_init(long baudrate);
+
+/// <summary>
+/// Enables the data register empty interrupt (USART0_UDRE_vect).
+/// </summary>
+void hal_uart_enable_tx_interrupt(void);
+
+/// <summary>
+/// Disables the data register empty interrupt (USART0_UDRE_vect).
+/// </summary>
+void hal_uart_disable_tx_interrupt(void);
+
+/// <summary>
+/// Writes a byte to the UART data register. Only valid from the data
+/// register empty interrupt handler.
+/// </summary>
+/// <param name="byte">The byte to transmit.</param>
+void hal_uart_write(uint8_t byte);
+
+/// <summary>
+/// Reads the last received byte. Only valid from the receive complete
+/// interrupt handler.
+/// </summary>
+/// <returns>The received byte.</returns>
+uint8_t hal_uart_read(void);
+
+/// <summary>
+/// Creates the standard I/O stream used for stdin and stdout.
+/// </summary>
+/// <param name="put">Character output function.</param>
+/// <param name="get">Character input function.</param>
+/// <returns>The stream.</returns>
+FILE *hal_uart_stream(int (*put)(char, FILE *), int (*get)(FILE *));
+
+#ifdef HAL_HOST
+/// <summary>
+/// Reports bytes just put in the UART output buffer to a harness (see
+/// HalHostHooks). Compiles to nothing on the hardware.
+/// </summary>
+/// <param name="data">The bytes.</param>
+/// <param name="count">The number of bytes.</param>
+void hal_uart_queued(const char *data, uint8_t count);
+#else
+#define hal_uart_queued(data, count)
+#endif
+
+//
+// Timer 0 (system clock tick).
+//
+
+// Timer 0 counts from 0 to HAL_TICK_PHASES - 1 in each millisecond, one
+// count every HAL_CYCLES_PER_PHASE CPU cycles.
+#define HAL_TICK_PHASES      	125
+#define HAL_CYCLES_PER_PHASE 	64
+
+/// <summary>
+/// Starts timer 0 generating TIMER0_COMPA_vect every millisecond.
+/// </summary>
+void hal_tick_init(void);
+
+/// <summary>
+/// Reads the timer 0 count, i.e. how far through the current millisecond the
+/// clock is. Used to time short sections of code.
+/// </summary>
+/// <returns>The count, from 0 to HAL_TICK_PHASES - 1.</returns>
+uint8_t hal_tick_phase(void);
+
+//
+// Timer 1 (piezo buzzer on OC1B).
+//
+
+/// <summary>
+/// Clears timer 1, enables its compare match A interrupt and makes OC1B an
+/// output.
+/// </summary>
+void hal_tone_init(void);
+
+/// <summary>
+/// Puts timer 1 in fast PWM mode (TOP = OCR1A, non-inverting OC1B) with its
+/// clock stopped.
+/// </summary>
+void hal_tone_enable_pwm(void);
+
+/// <summary>
+/// Sets the timer 1 TOP value (OCR1A).
+/// </summary>
+/// <param name="top">The TOP value.</param>
+void hal_tone_set_top(uint16_t top);
+
+/// <summary>
+/// Sets the timer 1 OC1B compare value.
+/// </summary>
+/// <param name="compare">The compare value.</param>
+void hal_tone_set_compare(uint16_t compare);
+
+/// <summary>
+/// Starts the timer 1 clock (CLK/8).
+/// </summary>
+void hal_tone_start(void);
+
+/// <summary>
+/// Stops the timer 1 clock.
+/// </summary>
+void hal_tone_stop(void);
+
+/// <summary>
+/// Saves the timer 1 clock state so that it can be restored later.
+/// </summary>
+/// <returns>The saved state.</returns>
+uint8_t hal_tone_save(void);
+
+/// <summary>
+/// Restores a timer 1 clock state returned by hal_tone_save().
+/// </summary>
+/// <param name="state">The saved state.</param>
+void hal_tone_restore(uint8_t state);
+
+//
+// Timer 2 (seven segment display multiplexing).
+//
+
+/// <summary>
+/// Sets timer 2 up for a 1ms compare match interrupt with its clock stopped,
+/// and makes the seven segment display pins outputs.
+/// </summary>
+void hal_ssd_init(void);
+
+/// <summary>
+/// Starts the timer 2 clock.
+/// </summary>
+void hal_ssd_start(void);
+
+/// <summary>
+/// Drives one digit of the seven segment display.
+/// </summary>
+/// <param name="digit">The digit to select (0 = right, 1 = left).</param>
+/// <param name="segments">The segment pattern.</param>
+void hal_ssd_write(uint8_t digit, uint8_t segments);
+
+//
+// Push buttons B0 - B3.
+//
+
+/// <summary>
+/// Enables the pin change interrupt (PCINT1_vect) for pins B0 to B3.
+/// </summary>
+void hal_buttons_init(void);
+
+/// <summary>
+/// Reads the state of the push buttons.
+/// </summary>
+/// <returns>Bits 0 to 3 hold the state of buttons B0 to B3.</returns>
+uint8_t hal_buttons_read(void);
+
+//
+// ADC (joystick).
+//
+
+/// <summary>
+/// Performs a single blocking ADC conversion against AVCC.
+/// </summary>
+/// <param name="channel">The ADC channel (0 = joystick X, 1 = joystick
+/// Y).</param>
+/// <returns>The 10-bit conversion result.</returns>
+uint16_t hal_adc_read(uint8_t channel);
+
+//
+// Port A (undo LEDs).
+//
+
+/// <summary>
+/// Makes the given port A pins outputs.
+/// </summary>
+/// <param name="mask">The pins to make outputs.</param>
+void hal_gpio_a_output(uint8_t mask);
+
+/// <summary>
+/// Drives the given port A pins high.
+/// </summary>
+/// <param name="mask">The pins to set.</param>
+void hal_gpio_a_set(uint8_t mask);
+
+/// <summary>
+/// Drives the given port A pins low.
+/// </summary>
+/// <param name="mask">The pins to clear.</param>
+void hal_gpio_a_clear(uint8_t mask);
+
+//
+// EEPROM.
+//
+
+/// <summary>
+/// Reads a byte of EEPROM. Erased bytes read as 0xFF.
+/// </summary>
+/// <param name="address">The EEPROM address.</param>
+/// <returns>The byte.</returns>
+uint8_t hal_eeprom_read(uint16_t address);
+
+/// <summary>
+/// Writes a byte of EEPROM, unless it already holds the value. Blocks until
+/// the write is complete (up to 3.4ms).
+/// </summary>
+/// <param name="address">The EEPROM address.</param>
+/// <param name="value">The byte to write.</param>
+void hal_eeprom_write(uint16_t address, uint8_t value);
+
+//
+// SRAM usage.
+//
+
+// Size of the ATmega324A SRAM in bytes.
+#define HAL_SRAM_BYTES 2048
+
+/// <summary>
+/// Gets the SRAM used by static variables (the .data and .bss sections).
+/// </summary>
+/// <returns>The size in bytes.</returns>
+uint16_t hal_sram_static_bytes(void);
+
+/// <summary>
+/// Gets the SRAM between the static variables and the deepest the stack has
+/// reached since reset. The memory is painted with a known pattern during
+/// start up and this counts the bytes that still hold it. The host backend
+/// has no SRAM model and reports all of it as unused.
+/// </summary>
+/// <returns>The number of bytes never used.</returns>
+uint16_t hal_sram_unused_bytes(void);
+
+#ifdef HAL_HOST
+
+//
+// Host-only functions, for benchmarks and fuzzers driving the simulation.
+//
+
+/// <summary>
+/// Gets the number of simulated CPU cycles since start up.
+/// </summary>
+/// <returns>The simulated cycle count.</returns>
+uint64_t hal_host_cycles(void);
+
+/// <summary>
+/// Charges simulated CPU cycles, firing any interrupts that become due.
+/// </summary>
+/// <param name="cycles">The number of cycles to charge.</param>
+void hal_host_consume(uint32_t cycles);
+
+/// <summary>
+/// Gets a pixel of the simulated LED matrix.
+/// </summary>
+/// <param name="row">The row number of the pixel.</param>
+/// <param name="col">The column number of the pixel.</param>
+/// <returns>The colour of the pixel.</returns>
+uint8_t hal_host_pixel(uint8_t row, uint8_t col);
+
+/// <summary>
+/// Gets the last segment pattern driven on a seven segment digit.
+/// </summary>
+/// <param name="digit">The digit (0 = right, 1 = left).</param>
+/// <returns>The segment pattern.</returns>
+uint8_t hal_host_ssd_segments(uint8_t digit);
+
+/// <summary>
+/// Gets the output state of port A.
+/// </summary>
+/// <returns>The port A output state.</returns>
+uint8_t hal_host_gpio_a(void);
+
+/// <summary>
+/// Sets the simulated push button state. A pin change interrupt fires the
+/// next time interrupts are serviced.
+/// </summary>
+/// <param name="state">Bits 0 to 3 hold the state of buttons B0 to
+/// B3.</param>
+void hal_host_set_buttons(uint8_t state);
+
+/// <summary>
+/// Sets the value returned by conversions on an ADC channel.
+/// </summary>
+/// <param name="channel">The ADC channel (0 or 1).</param>
+/// <param name="value">The 10-bit value.</param>
+void hal_host_set_adc(uint8_t channel, uint16_t value);
+
+/// <summary>
+/// Delivers a byte to the UART receiver as if it had arrived on the wire.
+/// Must be called with interrupts disabled (e.g. from a tick hook).
+/// </summary>
+/// <param name="byte">The received byte.</param>
+void hal_host_receive(uint8_t byte);
+
+// Callbacks into a benchmark or fuzzing harness. Any of them may be NULL.
+typedef struct
+{
+	// Called every simulated millisecond, with interrupts disabled.
+	void (*tick)(uint32_t ms);
+	// Called when a byte has finished shifting out over SPI.
+	void (*spi_sent)(uint8_t byte);
+	// Called for each byte put in the UART output buffer, whether it came
+	// through stdio or serial_write().
+	void (*uart_queued)(char c);
+	// Called when a byte is written to the UART data register.
+	void (*uart_sent)(uint8_t byte);
+	// Called when an ADC conversion completes.
+	void (*adc_read)(uint8_t channel, uint16_t value);
+	// Whether the harness supplies all UART input (stdin is not read).
+	bool own_input;
+	// Whether UART output is discarded instead of written to stdout.
+	bool discard_output;
+} HalHostHooks;
+
+/// <summary>
+/// Installs harness callbacks. Usually called from a constructor function so
+/// that it happens before main().
+/// </summary>
+/// <param name="hooks">The callbacks, which must outlive the program.</param>
+void hal_host_set_hooks(const HalHostHooks *hooks);
+
+#endif /* HAL_HOST */
+
+#endif /* HAL_H_ */
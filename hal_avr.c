@@ -0,0 +1,386 @@
+/*
+ * hal_avr.c
+ *
+ * Author: Jevi Waugh
+ *
+ * ATmega324A backend of the hardware abstraction layer. The register
+ * sequences here are the ones the drivers used to perform directly.
+ */
+
+#ifndef HAL_HOST
+
+#include "hal.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+
+bool hal_interrupts_enabled(void)
+{
+	return bit_is_set(SREG, SREG_I);
+}
+
+void hal_poll(void)
+{
+	// Nothing to do - the hardware makes progress on its own.
+}
+
+void hal_spi_init(uint8_t clockdivider)
+{
+	// Make the SS, MOSI and SCK pins outputs. These are pins 4, 5 and 7
+	// of port B on the ATmega324A.
+	DDRB |= (1 << DDB7) | (1 << DDB5) | (1 << DDB4);
+
+	// Set the slave select (SS) line high.
+	PORTB |= (1 << PORTB4);
+
+	// Set up the SPI control registers SPCR and SPSR. Enable SPI as use
+	// Master Mode by setting the SPE and MSTR bits of SPCR0.
+	SPCR0 = (1 << SPE0) | (1 << MSTR0);
+
+	// Set SPR0 and SPR1 bits in SPCR and SPI2X bit in SPSR based on the
+	// given clock divider. Invalid values default to the slowest speed.
+	// We consider each bit in turn.
+	switch (clockdivider)
+	{
+		case 2: // Fallthrough.
+		case 8: // Fallthrough.
+		case 32:
+			SPSR0 = (1 << SPI2X0);
+			break;
+		default:
+			SPSR0 = 0;
+			break;
+	}
+	switch (clockdivider)
+	{
+		case 128:
+			SPCR0 |= (1 << SPR00);
+			// Fallthrough.
+		case 32: // Fallthrough.
+		case 64:
+			SPCR0 |= (1 << SPR10);
+			break;
+		case 8: // Fallthrough.
+		case 16:
+			SPCR0 |= (1 << SPR00);
+			break;
+	}
+
+	// Take SS (slave select) line low.
+	PORTB &= ~(1 << PORTB4);
+}
+
+void hal_spi_enable_interrupt(void)
+{
+	SPCR0 |= (1 << SPIE0);
+}
+
+void hal_spi_write(uint8_t byte)
+{
+	// Write out the byte to the SPDR0 register. This will initiate the
+	// transfer.
+	SPDR0 = byte;
+}
+
+uint8_t hal_spi_wait(void)
+{
+	// Wait until the most significant bit of SPSR0 (SPIF0) is set - this
+	// indicates that the transfer is complete. The final read of SPSR0
+	// followed by a read of SPDR0 will cause the SPIF bit to be reset to
+	// 0. See page 173 of the ATmega324A datasheet for more info.
+	while ((SPSR0 & (1 << SPIF0)) == 0)
+	{
+		; // Wait.
+	}
+	return SPDR0;
+}
+
+void hal_uart_init(long baudrate)
+{
+	// Configure the baud rate. This differs from the datasheet formula so
+	// that we get rounding to the nearest integer while using integer
+	// division (which truncates).
+	UBRR0 = (uint16_t)((((HAL_CPU_HZ / (8 * baudrate)) + 1) / 2) - 1);
+
+	// Enable transmission and receiving via UART. We don't enable the UDR
+	// empty interrupt here (we wait until we've got a character to
+	// transmit). NOTE: Interrupts must be enabled globally for this
+	// module to work, but we do not do this here.
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+
+	// Enable receive complete interrupt.
+	UCSR0B |= (1 << RXCIE0);
+}
+
+void hal_uart_enable_tx_interrupt(void)
+{
+	UCSR0B |= (1 << UDRIE0);
+}
+
+void hal_uart_disable_tx_interrupt(void)
+{
+	UCSR0B &= ~(1 << UDRIE0);
+}
+
+void hal_uart_write(uint8_t byte)
+{
+	UDR0 = byte;
+}
+
+uint8_t hal_uart_read(void)
+{
+	return UDR0;
+}
+
+FILE *hal_uart_stream(int (*put)(char, FILE *), int (*get)(FILE *))
+{
+	static FILE stream;
+	fdev_setup_stream(&stream, put, get, _FDEV_SETUP_RW);
+	return &stream;
+}
+
+void hal_tick_init(void)
+{
+	// Set up timer 0 to generate an interrupt every 1ms. We will divide
+	// the clock by 64 and count up to 124. We will therefore get an
+	// interrupt every 64 x 125 clock cycles, i.e. every 1 milliseconds
+	// with an 8MHz clock. The counter will be reset to 0 when it reaches
+	// it's output compare value.
+
+	// Clear the timer.
+	TCNT0 = 0;
+
+	// Set the output compare value to be 124.
+	OCR0A = 124;
+
+	// Set the timer to clear on compare match (CTC mode) and to
+	// divide the clock by 64. This starts the timer running.
+	TCCR0A = (1 << WGM01);
+	TCCR0B = (1 << CS01) | (1 << CS00);
+
+	// Enable an interrupt on output compare match. Note that
+	// interrupts have to be enabled globally before the interrupts
+	// will fire.
+	TIMSK0 |= (1 << OCIE0A);
+
+	// Make sure the interrupt flag is cleared by writing a 1 to it.
+	TIFR0 = (1 << OCF0A);
+}
+
+uint8_t hal_tick_phase(void)
+{
+	return TCNT0;
+}
+
+void hal_tone_init(void)
+{
+	TCNT1 = 0;
+
+	// Enable interrupt on timer on output compare match.
+	TIMSK1 = (1 << OCIE1A);
+
+	// Ensure interrupt flag is cleared.
+	TIFR1 = (1 << OCF1A);
+
+	// Make pin OC1B be an output (port D, pin 4)
+	DDRD = (1 << 4);
+}
+
+void hal_tone_enable_pwm(void)
+{
+	// Set up timer/counter 1 for Fast PWM, counting from 0 to the value in
+	// OCR1A before reseting to 0. Configure output OC1B to be clear on
+	// compare match and set on timer/counter overflow (non-inverting
+	// mode). The clock is left stopped so the buzzer is silent until a
+	// tone is started.
+	TCCR1A = (1 << COM1B1) | (0 << COM1B0) | (1 << WGM11) | (1 << WGM10);
+	TCCR1B = (1 << WGM13) | (1 << WGM12);
+}
+
+void hal_tone_set_top(uint16_t top)
+{
+	OCR1A = top;
+}
+
+void hal_tone_set_compare(uint16_t compare)
+{
+	OCR1B = compare;
+}
+
+void hal_tone_start(void)
+{
+	TCCR1B |= (0 << CS12) | (1 << CS11) | (0 << CS10);
+}
+
+void hal_tone_stop(void)
+{
+	// Keep the WGM bits but clear the CS bits, leaving no clock source.
+	TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));
+}
+
+uint8_t hal_tone_save(void)
+{
+	return TCCR1B;
+}
+
+void hal_tone_restore(uint8_t state)
+{
+	TCCR1B = state;
+}
+
+void hal_ssd_init(void)
+{
+	TCNT2 = 0;
+
+	// Set up timer/counter 2 so that it reaches an output compare match
+	// every 1 millisecond once its clock is started by hal_ssd_start().
+	OCR2A = 249;
+	TCCR2A = (0 << COM2A1) | (1 << COM2A0)  // Toggle OC2A on compare match
+		| (0 << WGM21) | (0 << WGM20); // Least two significant WGM bits
+	TCCR2B = (1 << WGM22); // Two most significant WGM bits
+
+	// Enable interrupt on timer on output compare match.
+	TIMSK2 = (1 << OCIE2A);
+
+	// Ensure interrupt flag is cleared.
+	TIFR2 = (1 << OCF2A);
+
+	// Digit select (PD2) and segments (port C) are outputs.
+	DDRD |= (1 << 2);
+	PORTC = 0x00;
+	DDRC = 0xFF;
+}
+
+void hal_ssd_start(void)
+{
+	TCCR2B |= (0 << CS22) | (1 << CS21) | (1 << CS20);
+}
+
+void hal_ssd_write(uint8_t digit, uint8_t segments)
+{
+	PORTD = digit << 2; // Set PD2 to select right or left digit
+	PORTC = segments;
+}
+
+void hal_buttons_init(void)
+{
+	// Setup interrupt if any of pins B0 to B3 change. These pins
+	// correspond to pin change interrupts PCINT8 to PCINT11 which are
+	// covered by pin change interrupt 1.
+
+	// Enable the interrupt (see datasheet page 77).
+	PCICR |= (1 << PCIE1);
+
+	// Make sure the interrupt flag is cleared (by writing a
+	// 1 to it) (see datasheet page 78).
+	PCIFR |= (1 << PCIF1);
+
+	// Choose which pins we're interested in by setting
+	// the relevant bits in the mask register (see datasheet page 78).
+	PCMSK1 |= (1 << PCINT8) | (1 << PCINT9) | (1 << PCINT10) |
+		(1 << PCINT11);
+}
+
+uint8_t hal_buttons_read(void)
+{
+	return PINB & 0x0F;
+}
+
+uint16_t hal_adc_read(uint8_t channel)
+{
+	// AVCC reference, right adjust, and the requested input.
+	ADMUX = (1 << REFS0) | (channel & 0x07);
+
+	// Turn on the ADC with a clock divider of 64. (The ADC clock must be
+	// somewhere between 50kHz and 200kHz. We divide our 8MHz clock by 64
+	// to give us 125kHz.)
+	ADCSRA = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1);
+
+	// Start the ADC conversion
+	ADCSRA |= (1 << ADSC);
+	while (ADCSRA & (1 << ADSC))
+	{
+		; // Wait until conversion finished.
+	}
+	return ADC;
+}
+
+void hal_gpio_a_output(uint8_t mask)
+{
+	DDRA |= mask;
+}
+
+void hal_gpio_a_set(uint8_t mask)
+{
+	PORTA |= mask;
+}
+
+void hal_gpio_a_clear(uint8_t mask)
+{
+	PORTA &= ~mask;
+}
+
+uint8_t hal_eeprom_read(uint16_t address)
+{
+	return eeprom_read_byte((const uint8_t *)address);
+}
+
+void hal_eeprom_write(uint16_t address, uint8_t value)
+{
+	eeprom_update_byte((uint8_t *)address, value);
+}
+
+// Pattern used to paint the unused SRAM.
+#define STACK_PAINT 0xC5
+
+// Linker symbols: the start of .data, the end of .bss (and start of the
+// heap, which is not used) and the initial stack pointer (the end of SRAM).
+extern uint8_t __data_start;
+extern uint8_t _end;
+extern uint8_t __stack;
+
+// Paints all of the SRAM above the static variables, before main() runs.
+// This is placed in .init3, after the stack pointer has been set up but
+// before anything has been pushed on to the stack, and is written in
+// assembler so that it does not touch the stack itself.
+void hal_paint_stack(void) __attribute__((naked, used, section(".init3")));
+
+void hal_paint_stack(void)
+{
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_PAINT));
+}
+
+uint16_t hal_sram_static_bytes(void)
+{
+	return (uint16_t)&_end - (uint16_t)&__data_start;
+}
+
+uint16_t hal_sram_unused_bytes(void)
+{
+	// The stack grows down towards the static variables, so the paint
+	// survives from the end of .bss up to the deepest point it reached.
+	const uint8_t *p = &_end;
+	uint16_t count = 0;
+	while (p <= &__stack && *p == STACK_PAINT)
+	{
+		p++;
+		count++;
+	}
+	return count;
+}
+
+#endif /* HAL_HOST */
@@ -0,0 +1,824 @@
+/*
+ * hal_host.c
+ *
+ * Author: Jevi Waugh
+ *
+ * Linux backend of the hardware abstraction layer. Nothing here runs in
+ * real time: a simulated CPU cycle counter is advanced by every peripheral
+ * access (using the cost the access would have on an 8MHz ATmega324A) and
+ * by every software busy-wait (see hal_poll()). Whenever the counter passes
+ * the time an interrupt is due, and interrupts are enabled, the matching ISR
+ * is called directly.
+ *
+ *  - Timer 0/2 compare interrupts fire every simulated millisecond.
+ *  - Timer 1 compare interrupts fire once per PWM period while a tone plays.
+ *  - The UART transmits at the configured baud rate to stdout, and receives
+ *    from stdin, one byte per HAL_HOST_KEY_INTERVAL_MS (default 250ms) so
+ *    that piped keystrokes are not all swallowed by a single screen redraw.
+ *  - LED matrix SPI commands are decoded into an in-memory framebuffer. The
+ *    matrix is modelled as a slave that takes HAL_HOST_MATRIX_BYTE_CYCLES
+ *    (default 200) CPU cycles to process each byte and buffers up to
+ *    HAL_HOST_MATRIX_BUFFER (default 32) bytes; bytes arriving while the
+ *    buffer is full are lost, as they would be on the real board. Set the
+ *    byte cycles to 0 for a matrix that keeps up at any SPI speed.
+ *  - EEPROM starts erased. If HAL_HOST_EEPROM names a file, the EEPROM is
+ *    loaded from and saved to it, so that it persists between runs.
+ */
+
+#ifdef HAL_HOST
+
+#define _GNU_SOURCE
+#include "hal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define CYCLES_PER_MS (HAL_CPU_HZ / 1000)
+
+// Approximate cost of one pass around a software busy-wait loop.
+#define POLL_CYCLES 16
+
+// Cost of one ADC conversion: 13 ADC clocks at CLK/64.
+#define ADC_CYCLES (13 * 64)
+
+// How long to keep running after stdin is exhausted, so that the effects of
+// the last keystrokes are seen. We also wait for the UART to go idle.
+#define EOF_LINGER_MS 2000
+
+// LED matrix commands (these must match ledmatrix.c).
+#define CMD_UPDATE_ALL		(0x00)
+#define CMD_UPDATE_PIXEL	(0x01)
+#define CMD_UPDATE_ROW		(0x02)
+#define CMD_UPDATE_COL		(0x03)
+#define CMD_SHIFT_DISPLAY	(0x04)
+#define CMD_CLEAR_SCREEN	(0x0F)
+#define CMD_NONE        	(0xFF)
+
+#define MATRIX_ROWS 8
+#define MATRIX_COLS 16
+
+// Interrupt handlers. They are weak so that the backend still links when a
+// module is left out of a benchmark or fuzzing build.
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER2_COMPA_vect(void) __attribute__((weak));
+void USART0_RX_vect(void) __attribute__((weak));
+void USART0_UDRE_vect(void) __attribute__((weak));
+void SPI_STC_vect(void) __attribute__((weak));
+void PCINT1_vect(void) __attribute__((weak));
+
+// Simulated CPU state.
+static uint64_t cycles;
+static uint64_t next_ms_cycle = CYCLES_PER_MS;
+static uint32_t sim_ms;
+static bool interrupts_on;
+static bool in_isr;
+
+// Timers.
+static bool tick_enabled;
+static bool ssd_running;
+static bool tone_enabled;
+static bool tone_running;
+static uint16_t tone_top;
+static uint64_t next_tone_cycle;
+static uint8_t ssd_segments[2];
+
+// UART.
+static bool uart_enabled;
+static bool uart_tx_interrupt;
+static uint32_t uart_byte_cycles = 1;
+static uint64_t next_tx_cycle;
+static uint8_t uart_rx_byte;
+static uint32_t key_interval_ms = 250;
+static uint32_t next_key_ms;
+static bool stdin_eof;
+static uint32_t eof_ms;
+static char out_buf[4096];
+static size_t out_len;
+static int (*stream_put)(char, FILE *);
+static int (*stream_get)(FILE *);
+static FILE *stream;
+
+// Real time pacing.
+static bool realtime;
+static struct timespec start_wall;
+
+// SPI and the LED matrix framebuffer.
+static uint16_t spi_divider = 128;
+static uint8_t matrix[MATRIX_ROWS][MATRIX_COLS];
+static uint8_t spi_cmd = CMD_NONE;
+static uint8_t spi_arg;
+static uint8_t spi_count;
+static bool spi_interrupt;
+static bool spi_busy;
+static bool spi_flag;
+static uint8_t spi_byte;
+static uint64_t spi_done_cycle;
+static uint32_t matrix_byte_cycles = 200;
+static uint32_t matrix_buffer = 32;
+static uint64_t matrix_free_cycle;
+
+// EEPROM (1KB on the ATmega324A), loaded from eeprom_path on first use.
+#define EEPROM_BYTES 1024
+static uint8_t eeprom[EEPROM_BYTES];
+static bool eeprom_loaded;
+static const char *eeprom_path;
+
+// Harness callbacks.
+static const HalHostHooks no_hooks;
+static const HalHostHooks *hooks = &no_hooks;
+
+// Buttons, ADC and port A.
+static bool buttons_enabled;
+static bool buttons_changed;
+static uint8_t buttons_state;
+static uint16_t adc_value[8] = { 512, 512, 512, 512, 512, 512, 512, 512 };
+static uint8_t gpio_a;
+
+static void flush_output(void)
+{
+	size_t done = 0;
+	while (done < out_len)
+	{
+		ssize_t n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+		if (n <= 0)
+		{
+			break;
+		}
+		done += (size_t)n;
+	}
+	out_len = 0;
+}
+
+static void pace(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t wall_ms = (now.tv_sec - start_wall.tv_sec) * 1000 +
+		(now.tv_nsec - start_wall.tv_nsec) / 1000000;
+	if ((int64_t)sim_ms > wall_ms)
+	{
+		flush_output();
+		struct timespec delay = { 0, (long)(sim_ms - wall_ms) * 1000000L };
+		nanosleep(&delay, NULL);
+	}
+}
+
+static void receive_key(void)
+{
+	if (hooks->own_input || stdin_eof || sim_ms < next_key_ms)
+	{
+		return;
+	}
+	struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+	if (poll(&fd, 1, 0) <= 0)
+	{
+		return;
+	}
+	uint8_t byte;
+	if (read(STDIN_FILENO, &byte, 1) != 1)
+	{
+		stdin_eof = true;
+		eof_ms = sim_ms;
+		return;
+	}
+	next_key_ms = sim_ms + key_interval_ms;
+	hal_host_receive(byte);
+}
+
+// Runs every interrupt handler that has become due. Handlers run with
+// interrupts disabled, as they do on the AVR.
+static void service(void)
+{
+	if (!interrupts_on || in_isr)
+	{
+		return;
+	}
+	in_isr = true;
+	interrupts_on = false;
+
+	if (buttons_changed)
+	{
+		buttons_changed = false;
+		if (buttons_enabled && PCINT1_vect)
+		{
+			PCINT1_vect();
+		}
+	}
+	while (cycles >= next_ms_cycle)
+	{
+		next_ms_cycle += CYCLES_PER_MS;
+		sim_ms++;
+		if (tick_enabled && TIMER0_COMPA_vect)
+		{
+			TIMER0_COMPA_vect();
+		}
+		if (ssd_running && TIMER2_COMPA_vect)
+		{
+			TIMER2_COMPA_vect();
+		}
+		if (hooks->tick)
+		{
+			hooks->tick(sim_ms);
+		}
+		receive_key();
+		if (realtime)
+		{
+			pace();
+		}
+		if (stdin_eof && sim_ms >= eof_ms + EOF_LINGER_MS &&
+			!uart_tx_interrupt)
+		{
+			exit(0);
+		}
+	}
+	while (tone_running && cycles >= next_tone_cycle)
+	{
+		// The compare match happens once per PWM period (timer 1 counts
+		// at 1MHz, i.e. every 8 CPU cycles).
+		next_tone_cycle += (uint64_t)(tone_top + 1) * 8;
+		if (tone_enabled && TIMER1_COMPA_vect)
+		{
+			TIMER1_COMPA_vect();
+		}
+	}
+	if (spi_flag && spi_interrupt && SPI_STC_vect)
+	{
+		// Entering the handler clears the flag.
+		spi_flag = false;
+		SPI_STC_vect();
+	}
+	while (uart_tx_interrupt && cycles >= next_tx_cycle)
+	{
+		next_tx_cycle += uart_byte_cycles;
+		if (USART0_UDRE_vect)
+		{
+			USART0_UDRE_vect();
+		}
+		else
+		{
+			uart_tx_interrupt = false;
+		}
+	}
+
+	interrupts_on = true;
+	in_isr = false;
+}
+
+static void decode_spi(uint8_t byte);
+
+// Passes a byte to the LED matrix if its receive buffer has room. The bytes
+// are decoded straight away, but the matrix is busy until matrix_free_cycle.
+static void receive_matrix_byte(uint8_t byte)
+{
+	if (matrix_byte_cycles > 0)
+	{
+		if (matrix_free_cycle < cycles)
+		{
+			matrix_free_cycle = cycles;
+		}
+		uint64_t buffered = (matrix_free_cycle - cycles +
+			matrix_byte_cycles - 1) / matrix_byte_cycles;
+		if (buffered >= matrix_buffer)
+		{
+			// Receive buffer overrun - the byte is lost.
+			return;
+		}
+		matrix_free_cycle += matrix_byte_cycles;
+	}
+	decode_spi(byte);
+}
+
+// Completes the SPI transfer in progress once its time has passed. This
+// happens whether or not interrupts are enabled.
+static void progress_spi(void)
+{
+	if (spi_busy && cycles >= spi_done_cycle)
+	{
+		spi_busy = false;
+		spi_flag = true;
+		receive_matrix_byte(spi_byte);
+		if (hooks->spi_sent)
+		{
+			hooks->spi_sent(spi_byte);
+		}
+	}
+}
+
+static void decode_spi(uint8_t byte)
+{
+	if (spi_cmd == CMD_NONE)
+	{
+		spi_cmd = byte;
+		spi_count = 0;
+		if (byte == CMD_CLEAR_SCREEN)
+		{
+			memset(matrix, 0, sizeof(matrix));
+			spi_cmd = CMD_NONE;
+		}
+		else if (byte > CMD_SHIFT_DISPLAY)
+		{
+			// Unknown command, ignore it.
+			spi_cmd = CMD_NONE;
+		}
+		return;
+	}
+
+	uint8_t index = spi_count++;
+	switch (spi_cmd)
+	{
+		case CMD_UPDATE_ALL:
+			matrix[index / MATRIX_COLS][index % MATRIX_COLS] = byte;
+			if (spi_count == MATRIX_ROWS * MATRIX_COLS)
+			{
+				spi_cmd = CMD_NONE;
+			}
+			break;
+		case CMD_UPDATE_PIXEL:
+			if (index == 0)
+			{
+				spi_arg = byte;
+			}
+			else
+			{
+				matrix[(spi_arg >> 4) & 0x07][spi_arg & 0x0F] = byte;
+				spi_cmd = CMD_NONE;
+			}
+			break;
+		case CMD_UPDATE_ROW:
+			if (index == 0)
+			{
+				spi_arg = byte & 0x07;
+			}
+			else
+			{
+				matrix[spi_arg][index - 1] = byte;
+				if (index == MATRIX_COLS)
+				{
+					spi_cmd = CMD_NONE;
+				}
+			}
+			break;
+		case CMD_UPDATE_COL:
+			if (index == 0)
+			{
+				spi_arg = byte & 0x0F;
+			}
+			else
+			{
+				matrix[index - 1][spi_arg] = byte;
+				if (index == MATRIX_ROWS)
+				{
+					spi_cmd = CMD_NONE;
+				}
+			}
+			break;
+		case CMD_SHIFT_DISPLAY:
+			for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+			{
+				if (byte & 0x02)
+				{
+					memmove(&matrix[row][0], &matrix[row][1],
+						MATRIX_COLS - 1);
+					matrix[row][MATRIX_COLS - 1] = 0;
+				}
+				else if (byte & 0x01)
+				{
+					memmove(&matrix[row][1], &matrix[row][0],
+						MATRIX_COLS - 1);
+					matrix[row][0] = 0;
+				}
+			}
+			if (byte & 0x08)
+			{
+				memmove(matrix[1], matrix[0],
+					(MATRIX_ROWS - 1) * MATRIX_COLS);
+				memset(matrix[0], 0, MATRIX_COLS);
+			}
+			else if (byte & 0x04)
+			{
+				memmove(matrix[0], matrix[1],
+					(MATRIX_ROWS - 1) * MATRIX_COLS);
+				memset(matrix[MATRIX_ROWS - 1], 0, MATRIX_COLS);
+			}
+			spi_cmd = CMD_NONE;
+			break;
+		default:
+			spi_cmd = CMD_NONE;
+			break;
+	}
+}
+
+void hal_host_enable_interrupts(void)
+{
+	interrupts_on = true;
+	service();
+}
+
+void hal_host_disable_interrupts(void)
+{
+	interrupts_on = false;
+}
+
+bool hal_interrupts_enabled(void)
+{
+	return interrupts_on;
+}
+
+void hal_poll(void)
+{
+	hal_host_consume(POLL_CYCLES);
+}
+
+void hal_spi_init(uint8_t clockdivider)
+{
+	switch (clockdivider)
+	{
+		case 2: // Fallthrough.
+		case 4: // Fallthrough.
+		case 8: // Fallthrough.
+		case 16: // Fallthrough.
+		case 32: // Fallthrough.
+		case 64:
+			spi_divider = clockdivider;
+			break;
+		default:
+			spi_divider = 128;
+			break;
+	}
+	spi_interrupt = false;
+
+	const char *byte_cycles = getenv("HAL_HOST_MATRIX_BYTE_CYCLES");
+	if (byte_cycles)
+	{
+		matrix_byte_cycles = (uint32_t)strtoul(byte_cycles, NULL, 10);
+	}
+	const char *buffer = getenv("HAL_HOST_MATRIX_BUFFER");
+	if (buffer)
+	{
+		matrix_buffer = (uint32_t)strtoul(buffer, NULL, 10);
+	}
+}
+
+void hal_spi_enable_interrupt(void)
+{
+	spi_interrupt = true;
+}
+
+void hal_spi_write(uint8_t byte)
+{
+	// The transfer takes 8 cycles of the divided clock.
+	spi_byte = byte;
+	spi_busy = true;
+	spi_flag = false;
+	spi_done_cycle = cycles + 8U * spi_divider;
+}
+
+uint8_t hal_spi_wait(void)
+{
+	while (spi_busy)
+	{
+		hal_host_consume((uint32_t)(spi_done_cycle - cycles));
+	}
+	spi_flag = false;
+	return 0;
+}
+
+void hal_uart_init(long baudrate)
+{
+	// Ten bits (start, eight data, stop) per byte.
+	uart_byte_cycles = (uint32_t)((HAL_CPU_HZ * 10) / baudrate);
+	uart_enabled = true;
+
+	const char *interval = getenv("HAL_HOST_KEY_INTERVAL_MS");
+	if (interval)
+	{
+		key_interval_ms = (uint32_t)strtoul(interval, NULL, 10);
+	}
+	if (getenv("HAL_HOST_REALTIME"))
+	{
+		realtime = true;
+		clock_gettime(CLOCK_MONOTONIC, &start_wall);
+	}
+	atexit(flush_output);
+}
+
+void hal_uart_enable_tx_interrupt(void)
+{
+	if (!uart_tx_interrupt)
+	{
+		// The data register is empty, so the interrupt is due as soon
+		// as it is enabled.
+		uart_tx_interrupt = true;
+		if (next_tx_cycle < cycles)
+		{
+			next_tx_cycle = cycles;
+		}
+	}
+}
+
+void hal_uart_disable_tx_interrupt(void)
+{
+	uart_tx_interrupt = false;
+}
+
+void hal_uart_write(uint8_t byte)
+{
+	if (hooks->uart_sent)
+	{
+		hooks->uart_sent(byte);
+	}
+	if (hooks->discard_output)
+	{
+		return;
+	}
+	if (out_len == sizeof(out_buf))
+	{
+		flush_output();
+	}
+	out_buf[out_len++] = (char)byte;
+}
+
+uint8_t hal_uart_read(void)
+{
+	return uart_rx_byte;
+}
+
+void hal_uart_queued(const char *data, uint8_t count)
+{
+	if (hooks->uart_queued)
+	{
+		for (uint8_t i = 0; i < count; i++)
+		{
+			hooks->uart_queued(data[i]);
+		}
+	}
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size)
+{
+	(void)cookie;
+	for (size_t i = 0; i < size; i++)
+	{
+		stream_put(buf[i], stream);
+	}
+	return (ssize_t)size;
+}
+
+static ssize_t stream_read(void *cookie, char *buf, size_t size)
+{
+	(void)cookie;
+	if (size == 0)
+	{
+		return 0;
+	}
+	buf[0] = (char)stream_get(stream);
+	return 1;
+}
+
+FILE *hal_uart_stream(int (*put)(char, FILE *), int (*get)(FILE *))
+{
+	cookie_io_functions_t functions = { stream_read, stream_write, NULL,
+		NULL };
+	stream_put = put;
+	stream_get = get;
+	stream = fopencookie(NULL, "r+", functions);
+	setvbuf(stream, NULL, _IONBF, 0);
+	return stream;
+}
+
+void hal_tick_init(void)
+{
+	tick_enabled = true;
+}
+
+uint8_t hal_tick_phase(void)
+{
+	return (uint8_t)((cycles % CYCLES_PER_MS) / HAL_CYCLES_PER_PHASE);
+}
+
+void hal_tone_init(void)
+{
+	tone_enabled = true;
+}
+
+void hal_tone_enable_pwm(void)
+{
+	tone_running = false;
+}
+
+void hal_tone_set_top(uint16_t top)
+{
+	tone_top = top;
+}
+
+void hal_tone_set_compare(uint16_t compare)
+{
+	(void)compare;
+}
+
+void hal_tone_start(void)
+{
+	if (!tone_running)
+	{
+		tone_running = true;
+		next_tone_cycle = cycles + (uint64_t)(tone_top + 1) * 8;
+	}
+}
+
+void hal_tone_stop(void)
+{
+	tone_running = false;
+}
+
+uint8_t hal_tone_save(void)
+{
+	return tone_running;
+}
+
+void hal_tone_restore(uint8_t state)
+{
+	if (state)
+	{
+		hal_tone_start();
+	}
+	else
+	{
+		hal_tone_stop();
+	}
+}
+
+void hal_ssd_init(void)
+{
+	ssd_running = false;
+}
+
+void hal_ssd_start(void)
+{
+	ssd_running = true;
+}
+
+void hal_ssd_write(uint8_t digit, uint8_t segments)
+{
+	ssd_segments[digit & 1] = segments;
+}
+
+void hal_buttons_init(void)
+{
+	buttons_enabled = true;
+}
+
+uint8_t hal_buttons_read(void)
+{
+	return buttons_state;
+}
+
+uint16_t hal_adc_read(uint8_t channel)
+{
+	hal_host_consume(ADC_CYCLES);
+	uint16_t value = adc_value[channel & 0x07];
+	if (hooks->adc_read)
+	{
+		hooks->adc_read(channel, value);
+	}
+	return value;
+}
+
+void hal_gpio_a_output(uint8_t mask)
+{
+	(void)mask;
+}
+
+void hal_gpio_a_set(uint8_t mask)
+{
+	gpio_a |= mask;
+}
+
+void hal_gpio_a_clear(uint8_t mask)
+{
+	gpio_a &= ~mask;
+}
+
+static void load_eeprom(void)
+{
+	eeprom_loaded = true;
+	memset(eeprom, 0xFF, sizeof(eeprom));
+	eeprom_path = getenv("HAL_HOST_EEPROM");
+	if (eeprom_path)
+	{
+		FILE *f = fopen(eeprom_path, "rb");
+		if (f)
+		{
+			size_t n = fread(eeprom, 1, sizeof(eeprom), f);
+			(void)n;
+			fclose(f);
+		}
+	}
+}
+
+uint8_t hal_eeprom_read(uint16_t address)
+{
+	if (!eeprom_loaded)
+	{
+		load_eeprom();
+	}
+	return eeprom[address % EEPROM_BYTES];
+}
+
+void hal_eeprom_write(uint16_t address, uint8_t value)
+{
+	if (!eeprom_loaded)
+	{
+		load_eeprom();
+	}
+	if (eeprom[address % EEPROM_BYTES] == value)
+	{
+		return;
+	}
+	eeprom[address % EEPROM_BYTES] = value;
+	// An erase and write takes 3.4ms.
+	hal_host_consume(HAL_CPU_HZ / 1000 * 34 / 10);
+	if (eeprom_path)
+	{
+		FILE *f = fopen(eeprom_path, "wb");
+		if (f)
+		{
+			fwrite(eeprom, 1, sizeof(eeprom), f);
+			fclose(f);
+		}
+	}
+}
+
+uint16_t hal_sram_static_bytes(void)
+{
+	// The host has no model of the ATmega324A memory map.
+	return 0;
+}
+
+uint16_t hal_sram_unused_bytes(void)
+{
+	return HAL_SRAM_BYTES;
+}
+
+uint64_t hal_host_cycles(void)
+{
+	return cycles;
+}
+
+void hal_host_consume(uint32_t n)
+{
+	cycles += n;
+	progress_spi();
+	service();
+}
+
+uint8_t hal_host_pixel(uint8_t row, uint8_t col)
+{
+	return matrix[row % MATRIX_ROWS][col % MATRIX_COLS];
+}
+
+uint8_t hal_host_ssd_segments(uint8_t digit)
+{
+	return ssd_segments[digit & 1];
+}
+
+uint8_t hal_host_gpio_a(void)
+{
+	return gpio_a;
+}
+
+void hal_host_set_buttons(uint8_t state)
+{
+	state &= 0x0F;
+	if (state != buttons_state)
+	{
+		buttons_state = state;
+		buttons_changed = true;
+	}
+}
+
+void hal_host_set_adc(uint8_t channel, uint16_t value)
+{
+	adc_value[channel & 0x07] = value & 0x3FF;
+}
+
+void hal_host_receive(uint8_t byte)
+{
+	uart_rx_byte = byte;
+	if (uart_enabled && USART0_RX_vect)
+	{
+		USART0_RX_vect();
+	}
+}
+
+void hal_host_set_hooks(const HalHostHooks *new_hooks)
+{
+	hooks = new_hooks ? new_hooks : &no_hooks;
+}
+
+#endif /* HAL_HOST */
@@ -0,0 +1,196 @@
+/*
+ * isrtrace.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#ifdef ISR_TRACE
+
+#include "isrtrace.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal.h"
+#include "terminalio.h"
+
+// A tick entered this many timer 0 counts (or more) after the compare match
+// is counted as late.
+#define LATE_PHASES 2
+
+// Marks an exit event in the ring buffer. The low bits hold the IsrTraceId.
+#define EVENT_EXIT 0x80
+
+// Culprit recorded when no handler was running as the tick fell due, i.e.
+// the main program had interrupts disabled.
+#define CULPRIT_MAIN ISR_TRACE_NUM_ISRS
+
+typedef struct
+{
+	uint16_t ms;
+	uint8_t phase;
+	uint8_t event;
+} TraceEvent;
+
+static const char isr_names[ISR_TRACE_NUM_ISRS + 1][7] PROGMEM =
+{
+	"TIMER0", "TIMER1", "TIMER2", "RX", "UDRE", "PCINT1", "SPI", "main"
+};
+
+// The ring buffer. insert_pos is the next event to write, and once the
+// buffer has wrapped it is also the oldest event.
+static TraceEvent events[ISR_TRACE_SIZE];
+static uint8_t insert_pos;
+static bool wrapped;
+static volatile bool paused;
+
+// Milliseconds, counted by tick entries.
+static uint16_t trace_ms;
+
+// The phase at which the running handler was entered. Handlers do not
+// nest, so one is enough.
+static uint8_t entry_phase;
+
+// The handler (if any) that was running when the last millisecond boundary
+// passed.
+static uint8_t straddler = CULPRIT_MAIN;
+
+// Tick lateness and the longest run of each handler, in timer 0 counts.
+static uint8_t max_tick_late;
+static uint8_t max_late_culprit = CULPRIT_MAIN;
+static uint32_t late_ticks;
+static uint8_t max_run[ISR_TRACE_NUM_ISRS];
+
+static void record(uint8_t event, uint8_t phase)
+{
+	if (paused)
+	{
+		return;
+	}
+	events[insert_pos].ms = trace_ms;
+	events[insert_pos].phase = phase;
+	events[insert_pos].event = event;
+	if (++insert_pos == ISR_TRACE_SIZE)
+	{
+		insert_pos = 0;
+		wrapped = true;
+	}
+}
+
+void isr_trace_enter(IsrTraceId id)
+{
+	uint8_t phase = hal_tick_phase();
+	entry_phase = phase;
+	if (id == ISR_TRACE_TIMER0)
+	{
+		// The compare match reset the count to 0, so the count is how
+		// late the tick is.
+		if (phase >= LATE_PHASES)
+		{
+			late_ticks++;
+		}
+		if (phase > max_tick_late)
+		{
+			max_tick_late = phase;
+			max_late_culprit = straddler;
+		}
+		straddler = CULPRIT_MAIN;
+		trace_ms++;
+	}
+	record(id, phase);
+}
+
+void isr_trace_exit(IsrTraceId id)
+{
+	uint8_t phase = hal_tick_phase();
+	// Handlers run for well under a millisecond, so the count can only
+	// have wrapped around once.
+	uint8_t run = (uint8_t)(phase + HAL_TICK_PHASES - entry_phase) %
+		HAL_TICK_PHASES;
+	if (run > max_run[id])
+	{
+		max_run[id] = run;
+	}
+	if (phase < entry_phase)
+	{
+		straddler = id;
+	}
+	record(id | EVENT_EXIT, phase);
+}
+
+static void new_line(void)
+{
+	printf_P(PSTR("\n"));
+	clear_to_end_of_line();
+}
+
+static void print_name(uint8_t id)
+{
+	char name[7];
+	memcpy_P(name, isr_names[id], sizeof(name));
+	printf_P(PSTR("%-6s"), name);
+}
+
+void isr_trace_dump(void)
+{
+	// Freeze the ring buffer. Printing fires the UART interrupts, which
+	// would otherwise overwrite the events being printed.
+	paused = true;
+
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	uint8_t late = max_tick_late;
+	uint8_t culprit = max_late_culprit;
+	uint32_t late_count = late_ticks;
+	uint8_t runs[ISR_TRACE_NUM_ISRS];
+	for (uint8_t id = 0; id < ISR_TRACE_NUM_ISRS; id++)
+	{
+		runs[id] = max_run[id];
+	}
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+
+	move_terminal_cursor(24, 0);
+	clear_to_end_of_line();
+	printf_P(PSTR("ISR trace: %lu late ticks, worst %u cycles late (during "),
+		(unsigned long)late_count, late * HAL_CYCLES_PER_PHASE);
+	print_name(culprit);
+	printf_P(PSTR(")"));
+	new_line();
+	printf_P(PSTR("Longest run:"));
+	for (uint8_t id = 0; id < ISR_TRACE_NUM_ISRS; id++)
+	{
+		printf_P(PSTR(" "));
+		print_name(id);
+		printf_P(PSTR(" %u"), runs[id] * HAL_CYCLES_PER_PHASE);
+	}
+
+	// Events oldest first, four to a line, as ms.count +/-handler.
+	uint8_t count = wrapped ? ISR_TRACE_SIZE : insert_pos;
+	uint8_t pos = wrapped ? insert_pos : 0;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (i % 4 == 0)
+		{
+			new_line();
+		}
+		else
+		{
+			printf_P(PSTR("  "));
+		}
+		const TraceEvent *event = &events[pos];
+		printf_P(PSTR("%5u.%03u %c"), event->ms, event->phase,
+			(event->event & EVENT_EXIT) ? '-' : '+');
+		print_name(event->event & ~EVENT_EXIT);
+		if (++pos == ISR_TRACE_SIZE)
+		{
+			pos = 0;
+		}
+	}
+	new_line();
+
+	paused = false;
+}
+
+#endif /* ISR_TRACE */
@@ -0,0 +1,75 @@
+/*
+ * isrtrace.h
+ *
+ * Author: Jevi Waugh
+ *
+ * Interrupt latency and jitter tracer. When the project is built with
+ * ISR_TRACE defined (e.g. with -DISR_TRACE), every interrupt handler records
+ * its entry and exit in a RAM ring buffer, timestamped with the millisecond
+ * count and the timer 0 count within the millisecond (one count every
+ * HAL_CYCLES_PER_PHASE = 64 CPU cycles). The tracer also keeps how late the
+ * 1ms tick (TIMER0_COMPA_vect) has been, what delayed it, and the longest
+ * run of each handler. Without ISR_TRACE the trace macros compile to nothing.
+ *
+ * The millisecond count is advanced when the tick handler is entered, so
+ * events between the timer 0 compare match and a late tick carry the
+ * previous millisecond.
+ */
+
+#ifndef ISRTRACE_H_
+#define ISRTRACE_H_
+
+#include <stdint.h>
+
+// The traced interrupt handlers.
+typedef enum
+{
+	ISR_TRACE_TIMER0,
+	ISR_TRACE_TIMER1,
+	ISR_TRACE_TIMER2,
+	ISR_TRACE_USART_RX,
+	ISR_TRACE_USART_UDRE,
+	ISR_TRACE_PCINT1,
+	ISR_TRACE_SPI,
+	ISR_TRACE_NUM_ISRS
+} IsrTraceId;
+
+#ifdef ISR_TRACE
+
+// Number of events held in the ring buffer (4 bytes each).
+#ifndef ISR_TRACE_SIZE
+#define ISR_TRACE_SIZE 32
+#endif
+
+#define ISR_TRACE_ENTER(id) isr_trace_enter(id)
+#define ISR_TRACE_EXIT(id) isr_trace_exit(id)
+
+/// <summary>
+/// Records entry to an interrupt handler. Must be the first statement of
+/// the handler.
+/// </summary>
+/// <param name="id">The handler.</param>
+void isr_trace_enter(IsrTraceId id);
+
+/// <summary>
+/// Records exit from an interrupt handler. Must be the last statement of
+/// the handler.
+/// </summary>
+/// <param name="id">The handler.</param>
+void isr_trace_exit(IsrTraceId id);
+
+/// <summary>
+/// Prints the tick lateness summary, the longest run of each handler and
+/// the contents of the ring buffer to stdout. Recording into the ring buffer
+/// is paused while it is printed.
+/// </summary>
+void isr_trace_dump(void);
+
+#else
+
+#define ISR_TRACE_ENTER(id)
+#define ISR_TRACE_EXIT(id)
+
+#endif /* ISR_TRACE */
+
+#endif /* ISRTRACE_H_ */
@@ -6,8 +6,10 @@
 
 #include "ledmatrix.h"
 #include <stdint.h>
+#include <stdbool.h>
 #include "spi.h"
 #include "pixel_colour.h"
+#include "hal.h"
 
 #define CMD_UPDATE_ALL		(0x00)
 #define CMD_UPDATE_PIXEL	(0x01)
@@ -16,95 +18,544 @@
 #define CMD_SHIFT_DISPLAY	(0x04)
 #define CMD_CLEAR_SCREEN	(0x0F)
 
+// Length of each command on the wire, including the command byte.
+#define LEN_UPDATE_ALL  	(1 + MATRIX_NUM_ROWS * MATRIX_NUM_COLUMNS)
+#define LEN_UPDATE_PIXEL	(3)
+#define LEN_UPDATE_ROW  	(2 + MATRIX_NUM_COLUMNS)
+#define LEN_UPDATE_COL  	(2 + MATRIX_NUM_ROWS)
+#define LEN_SHIFT_DISPLAY	(2)
+#define LEN_CLEAR_SCREEN	(1)
+
+#ifdef LEDMATRIX_STATS
+static uint32_t command_count[LEDMATRIX_NUM_COMMANDS];
+#define COUNT_COMMAND(type) (command_count[(type)]++)
+#else
+#define COUNT_COMMAND(type)
+#endif
+
+// A copy of the display contents. Pixels drawn with ledmatrix_draw_pixel()
+// are changed here first and marked dirty (bit col of dirty_rows[row]) until
+// ledmatrix_flush() sends them. All other pixels match the matrix.
+static MatrixData shadow;
+static uint16_t dirty_rows[MATRIX_NUM_ROWS];
+
+// How many ledmatrix_begin_frame() calls are waiting for their
+// ledmatrix_commit_frame(). Within a frame nothing is sent, except by the
+// shift functions.
+static uint8_t frame_depth;
+
+static void send_dirty(void);
+
+// The SPI clock divider found by ledmatrix_calibrate() is kept in EEPROM,
+// followed by its complement so that erased or corrupt values are ignored.
+#define EEPROM_DIVIDER_ADDR 0
+
+// The slowest divider. This speed guarantees the SPI buffer will never
+// overflow on the LED matrix.
+#define SAFE_DIVIDER 128
+
+// Number of test frames sent back to back at each divider. The last one is
+// checked.
+#define CALIBRATION_FRAMES 3
+
+static uint8_t divider = SAFE_DIVIDER;
+
+static bool valid_divider(uint8_t value)
+{
+	// One of 2, 4, ..., 128.
+	return value >= 2 && (value & (value - 1)) == 0;
+}
+
 void init_ledmatrix(void)
 {
-	// Setup SPI, with a clock devider of 128. This speed guarantees the
-	// SPI buffer will never overflow on the LED matrix.
-	spi_setup_master(128);
+	// Setup SPI, with the calibrated clock divider if there is one, or
+	// else a clock devider of 128.
+	uint8_t stored = hal_eeprom_read(EEPROM_DIVIDER_ADDR);
+	uint8_t check = hal_eeprom_read(EEPROM_DIVIDER_ADDR + 1);
+	divider = (valid_divider(stored) && (uint8_t)(check ^ stored) == 0xFF) ?
+		stored : SAFE_DIVIDER;
+	spi_setup_master(divider);
+
+	// Start from a known (blank) display, to match the shadow copy.
+	ledmatrix_clear();
 }
 
-void ledmatrix_update_all(MatrixData data)
+static void send_all(MatrixData data)
 {
-	(void)spi_send_byte(CMD_UPDATE_ALL);
+	COUNT_COMMAND(LEDMATRIX_UPDATE_ALL);
+	spi_queue_byte(CMD_UPDATE_ALL);
 	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
 	{
 		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
 		{
-			(void)spi_send_byte(data[row][col]);
+			shadow[row][col] = data[row][col];
+			spi_queue_byte(data[row][col]);
 		}
+		dirty_rows[row] = 0;
 	}
 }
 
-void ledmatrix_update_pixel(uint8_t row, uint8_t col, PixelColour pixel)
+static void send_pixel(uint8_t row, uint8_t col, PixelColour pixel)
 {
 	if (col >= MATRIX_NUM_COLUMNS || row >= MATRIX_NUM_ROWS)
 	{
 		// Invalid location, ignore the request.
 		return;
 	}
-	(void)spi_send_byte(CMD_UPDATE_PIXEL);
-	(void)spi_send_byte(((row & 0x07) << 4) | (col & 0x0F));
-	(void)spi_send_byte(pixel);
+	if (shadow[row][col] == pixel && !(dirty_rows[row] & (1U << col)))
+	{
+		// The matrix already shows this colour.
+		return;
+	}
+	shadow[row][col] = pixel;
+	dirty_rows[row] &= ~(1U << col);
+	COUNT_COMMAND(LEDMATRIX_UPDATE_PIXEL);
+	spi_queue_byte(CMD_UPDATE_PIXEL);
+	spi_queue_byte(((row & 0x07) << 4) | (col & 0x0F));
+	spi_queue_byte(pixel);
 }
 
-void ledmatrix_update_row(uint8_t row, MatrixRow data)
+static void send_row(uint8_t row, MatrixRow data)
 {
 	if (row >= MATRIX_NUM_ROWS)
 	{
 		// Invalid row number, ignore the request.
 		return;
 	}
-	(void)spi_send_byte(CMD_UPDATE_ROW);
-	(void)spi_send_byte(row & 0x07);
+	COUNT_COMMAND(LEDMATRIX_UPDATE_ROW);
+	spi_queue_byte(CMD_UPDATE_ROW);
+	spi_queue_byte(row & 0x07);
+	dirty_rows[row] = 0;
 	for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
 	{
-		(void)spi_send_byte(data[col]);
+		shadow[row][col] = data[col];
+		spi_queue_byte(data[col]);
 	}
 }
 
-void ledmatrix_update_column(uint8_t col, MatrixColumn data)
+static void send_column(uint8_t col, MatrixColumn data)
 {
 	if (col >= MATRIX_NUM_COLUMNS)
 	{
 		// Invalid column number, ignore the request.
 		return;
 	}
-	(void)spi_send_byte(CMD_UPDATE_COL);
-	(void)spi_send_byte(col & 0x0F);
+	COUNT_COMMAND(LEDMATRIX_UPDATE_COL);
+	spi_queue_byte(CMD_UPDATE_COL);
+	spi_queue_byte(col & 0x0F);
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		shadow[row][col] = data[row];
+		dirty_rows[row] &= ~(1U << col);
+		spi_queue_byte(data[row]);
+	}
+}
+
+void ledmatrix_update_all(MatrixData data)
+{
+	if (frame_depth == 0)
+	{
+		send_all(data);
+		return;
+	}
 	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
 	{
-		(void)spi_send_byte(data[row]);
+		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+		{
+			ledmatrix_draw_pixel(row, col, data[row][col]);
+		}
+	}
+}
+
+void ledmatrix_update_pixel(uint8_t row, uint8_t col, PixelColour pixel)
+{
+	if (frame_depth == 0)
+	{
+		send_pixel(row, col, pixel);
+	}
+	else
+	{
+		ledmatrix_draw_pixel(row, col, pixel);
+	}
+}
+
+void ledmatrix_update_row(uint8_t row, MatrixRow data)
+{
+	if (frame_depth == 0)
+	{
+		send_row(row, data);
+		return;
+	}
+	for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+	{
+		ledmatrix_draw_pixel(row, col, data[col]);
+	}
+}
+
+void ledmatrix_update_column(uint8_t col, MatrixColumn data)
+{
+	if (frame_depth == 0)
+	{
+		send_column(col, data);
+		return;
+	}
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		ledmatrix_draw_pixel(row, col, data[row]);
+	}
+}
+
+// Sends a shift command and shifts the shadow copy to match. Pending
+// pixels are sent first so that the shift moves what they should show.
+// Pixels shifted in from outside the display are blank.
+static void shift_display(uint8_t direction, int8_t delta_row,
+	int8_t delta_col)
+{
+	send_dirty();
+	COUNT_COMMAND(LEDMATRIX_SHIFT_DISPLAY);
+	spi_queue_byte(CMD_SHIFT_DISPLAY);
+	spi_queue_byte(direction);
+
+	// Copy in the order that never overwrites a pixel before it is read.
+	for (uint8_t i = 0; i < MATRIX_NUM_ROWS; i++)
+	{
+		uint8_t row = (delta_row > 0) ? MATRIX_NUM_ROWS - 1 - i : i;
+		for (uint8_t j = 0; j < MATRIX_NUM_COLUMNS; j++)
+		{
+			uint8_t col = (delta_col > 0) ? MATRIX_NUM_COLUMNS - 1 - j : j;
+			int8_t from_row = row - delta_row;
+			int8_t from_col = col - delta_col;
+			if (from_row < 0 || from_row >= MATRIX_NUM_ROWS ||
+				from_col < 0 || from_col >= MATRIX_NUM_COLUMNS)
+			{
+				shadow[row][col] = COLOUR_BLACK;
+			}
+			else
+			{
+				shadow[row][col] = shadow[from_row][from_col];
+			}
+		}
 	}
 }
 
 void ledmatrix_shift_display_left(void)
 {
-	(void)spi_send_byte(CMD_SHIFT_DISPLAY);
-	(void)spi_send_byte(0x02);
+	shift_display(0x02, 0, -1);
 }
 
 void ledmatrix_shift_display_right(void)
 {
-	(void)spi_send_byte(CMD_SHIFT_DISPLAY);
-	(void)spi_send_byte(0x01);
+	shift_display(0x01, 0, 1);
 }
 
 void ledmatrix_shift_display_up(void)
 {
-	(void)spi_send_byte(CMD_SHIFT_DISPLAY);
-	(void)spi_send_byte(0x08);
+	shift_display(0x08, 1, 0);
 }
 
 void ledmatrix_shift_display_down(void)
 {
-	(void)spi_send_byte(CMD_SHIFT_DISPLAY);
-	(void)spi_send_byte(0x04);
+	shift_display(0x04, -1, 0);
 }
 
 void ledmatrix_clear(void)
 {
-	(void)spi_send_byte(CMD_CLEAR_SCREEN);
+	if (frame_depth > 0)
+	{
+		for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+		{
+			for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+			{
+				ledmatrix_draw_pixel(row, col, COLOUR_BLACK);
+			}
+		}
+		return;
+	}
+	COUNT_COMMAND(LEDMATRIX_CLEAR_SCREEN);
+	spi_queue_byte(CMD_CLEAR_SCREEN);
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		set_matrix_row_to_colour(shadow[row], COLOUR_BLACK);
+		dirty_rows[row] = 0;
+	}
+}
+
+void ledmatrix_blank(void)
+{
+	send_dirty();
+	COUNT_COMMAND(LEDMATRIX_CLEAR_SCREEN);
+	spi_queue_byte(CMD_CLEAR_SCREEN);
+	// The shadow copy is kept, and every pixel that is not black now
+	// differs from the matrix.
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		dirty_rows[row] = 0;
+		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+		{
+			if (shadow[row][col] != COLOUR_BLACK)
+			{
+				dirty_rows[row] |= 1U << col;
+			}
+		}
+	}
+}
+
+void ledmatrix_wait(void)
+{
+	spi_wait();
+}
+
+uint8_t ledmatrix_get_divider(void)
+{
+	return divider;
+}
+
+// Brings the LED matrix back to a known state after it may have lost bytes,
+// leaving it blank. It could be part way through any command, the longest
+// being CMD_UPDATE_ALL, so we send enough clear commands at the safe speed
+// to finish that command and then clear the display.
+static void resynchronise(void)
+{
+	spi_set_clock_divider(SAFE_DIVIDER);
+	for (uint8_t i = 0; i < LEN_UPDATE_ALL; i++)
+	{
+		ledmatrix_clear();
+	}
+	spi_wait();
+}
+
+uint8_t ledmatrix_calibrate(bool (*pattern_shown)(MatrixData pattern))
+{
+	static const PixelColour colours[4] PROGMEM =
+	{
+		COLOUR_RED, COLOUR_GREEN, COLOUR_YELLOW, COLOUR_ORANGE
+	};
+
+	// Try the fastest divider first and halve the speed until the
+	// pattern gets through. The safe divider is used if nothing else
+	// works.
+	uint8_t chosen = SAFE_DIVIDER;
+	for (uint8_t value = 2; value < SAFE_DIVIDER; value <<= 1)
+	{
+		resynchronise();
+		divider = value;
+		spi_set_clock_divider(divider);
+		for (uint8_t frame = 0; frame < CALIBRATION_FRAMES; frame++)
+		{
+			// Diagonal stripes, moved along one pixel each frame.
+			// The shadow copy is the frame buffer.
+			for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+			{
+				for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+				{
+					shadow[row][col] = pgm_read_byte(
+						&colours[(row + col + frame) & 3]);
+				}
+			}
+			send_all(shadow);
+		}
+		spi_wait();
+		if (pattern_shown(shadow))
+		{
+			chosen = value;
+			break;
+		}
+	}
+
+	resynchronise();
+	divider = chosen;
+	spi_set_clock_divider(divider);
+	hal_eeprom_write(EEPROM_DIVIDER_ADDR, divider);
+	hal_eeprom_write(EEPROM_DIVIDER_ADDR + 1, (uint8_t)~divider);
+	return divider;
+}
+
+void ledmatrix_draw_pixel(uint8_t row, uint8_t col, PixelColour pixel)
+{
+	if (row >= MATRIX_NUM_ROWS || col >= MATRIX_NUM_COLUMNS)
+	{
+		// Invalid location, ignore the request.
+		return;
+	}
+	if (shadow[row][col] != pixel)
+	{
+		shadow[row][col] = pixel;
+		dirty_rows[row] |= (1U << col);
+	}
+}
+
+static uint8_t count_bits(uint16_t bits)
+{
+	uint8_t count = 0;
+	for (; bits; bits &= bits - 1)
+	{
+		count++;
+	}
+	return count;
+}
+
+// Plans how to send the dirty pixels with whole row and column commands
+// where they are cheaper than pixel commands. Rows are considered before
+// columns if rows_first is set, otherwise columns are considered first.
+// Returns the number of bytes the plan sends.
+static uint16_t plan_flush(bool rows_first, uint8_t *rows, uint16_t *cols)
+{
+	// A row command (LEN_UPDATE_ROW bytes) beats 6 pixel commands and a
+	// column command (LEN_UPDATE_COL bytes) beats 3.
+	const uint8_t row_threshold = LEN_UPDATE_ROW / LEN_UPDATE_PIXEL + 1;
+	const uint8_t col_threshold = LEN_UPDATE_COL / LEN_UPDATE_PIXEL + 1;
+	*rows = 0;
+	*cols = 0;
+	for (uint8_t pass = 0; pass < 2; pass++)
+	{
+		if ((pass == 0) == rows_first)
+		{
+			for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+			{
+				uint16_t left = dirty_rows[row] & ~*cols;
+				if (count_bits(left) >= row_threshold)
+				{
+					*rows |= (1 << row);
+				}
+			}
+		}
+		else
+		{
+			for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+			{
+				uint8_t count = 0;
+				for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+				{
+					if (!(*rows & (1 << row)) &&
+						(dirty_rows[row] & (1U << col)))
+					{
+						count++;
+					}
+				}
+				if (count >= col_threshold)
+				{
+					*cols |= (1U << col);
+				}
+			}
+		}
+	}
+
+	uint16_t bytes = count_bits(*rows) * LEN_UPDATE_ROW +
+		count_bits(*cols) * LEN_UPDATE_COL;
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		if (!(*rows & (1 << row)))
+		{
+			bytes += count_bits(dirty_rows[row] & ~*cols) *
+				LEN_UPDATE_PIXEL;
+		}
+	}
+	return bytes;
+}
+
+// Sends the dirty pixels, even within a frame.
+static void send_dirty(void)
+{
+	bool any_dirty = false;
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		if (dirty_rows[row])
+		{
+			any_dirty = true;
+		}
+	}
+	if (!any_dirty)
+	{
+		return;
+	}
+
+	// Pick the cheapest of the row first plan, the column first plan and
+	// updating the whole display.
+	uint8_t rows, other_rows;
+	uint16_t cols, other_cols;
+	uint16_t bytes = plan_flush(true, &rows, &cols);
+	uint16_t other_bytes = plan_flush(false, &other_rows, &other_cols);
+	if (other_bytes < bytes)
+	{
+		bytes = other_bytes;
+		rows = other_rows;
+		cols = other_cols;
+	}
+	if (bytes >= LEN_UPDATE_ALL)
+	{
+		send_all(shadow);
+		return;
+	}
+
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		if (rows & (1 << row))
+		{
+			send_row(row, shadow[row]);
+		}
+	}
+	for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+	{
+		if (cols & (1U << col))
+		{
+			MatrixColumn column;
+			for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+			{
+				column[row] = shadow[row][col];
+			}
+			send_column(col, column);
+		}
+	}
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		for (uint8_t col = 0; dirty_rows[row]; col++)
+		{
+			if (dirty_rows[row] & (1U << col))
+			{
+				// Sends the pixel and clears its dirty bit.
+				send_pixel(row, col, shadow[row][col]);
+			}
+		}
+	}
+}
+
+void ledmatrix_flush(void)
+{
+	if (frame_depth == 0)
+	{
+		send_dirty();
+	}
+}
+
+void ledmatrix_begin_frame(void)
+{
+	frame_depth++;
+}
+
+void ledmatrix_commit_frame(void)
+{
+	if (frame_depth > 0 && --frame_depth == 0)
+	{
+		send_dirty();
+	}
+}
+
+#ifdef LEDMATRIX_STATS
+void ledmatrix_get_stats(LedMatrixStats *stats)
+{
+	static const uint8_t command_length[LEDMATRIX_NUM_COMMANDS] =
+	{
+		LEN_UPDATE_ALL, LEN_UPDATE_PIXEL, LEN_UPDATE_ROW, LEN_UPDATE_COL,
+		LEN_SHIFT_DISPLAY, LEN_CLEAR_SCREEN
+	};
+	for (uint8_t type = 0; type < LEDMATRIX_NUM_COMMANDS; type++)
+	{
+		stats->commands[type] = command_count[type];
+		stats->bytes[type] = command_count[type] * command_length[type];
+	}
+	spi_get_stats(&stats->spi);
 }
+#endif
 
 void copy_matrix_column(MatrixColumn from, MatrixColumn to)
 {
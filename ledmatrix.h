@@ -11,7 +11,9 @@
 #define LEDMATRIX_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "pixel_colour.h"
+#include "spi.h"
 
 // The matrix has 8 rows (0 - 7, bottom to top) and 16 columns (0 - 15,
 // left to right).
@@ -32,7 +34,9 @@ void init_ledmatrix(void);
 
 
 //
-// Functions to update the display.
+// Functions to update the display. The commands are queued and sent by the
+// SPI driver in the background (see spi.h), so these functions return
+// without waiting unless the queue is full.
 //
 
 /// <summary>
@@ -88,6 +92,84 @@ void ledmatrix_shift_display_down(void);
 /// </summary>
 void ledmatrix_clear(void);
 
+/// <summary>
+/// Waits until every queued command has been sent to the LED matrix.
+/// </summary>
+void ledmatrix_wait(void);
+
+//
+// Buffered drawing. The module keeps a copy of what the matrix shows.
+// Pixels drawn with ledmatrix_draw_pixel() only change that copy, and
+// ledmatrix_flush() then sends all the changed pixels with whichever mix of
+// pixel, row, column and whole display updates is the fewest bytes. The
+// ledmatrix_update_... functions above send immediately and also keep the
+// copy up to date; ledmatrix_update_pixel() sends nothing if the pixel
+// already shows the colour.
+//
+
+/// <summary>
+/// Sets the colour of a pixel, to be sent by the next ledmatrix_flush().
+/// Nothing is sent if the pixel already shows the colour.
+/// </summary>
+/// <param name="row">The row number of the pixel.</param>
+/// <param name="col">The column number of the pixel.</param>
+/// <param name="pixel">New colour of the pixel.</param>
+void ledmatrix_draw_pixel(uint8_t row, uint8_t col, PixelColour pixel);
+
+/// <summary>
+/// Sends all pixels changed by ledmatrix_draw_pixel() since the last flush,
+/// using the cheapest commands.
+/// </summary>
+void ledmatrix_flush(void);
+
+/// <summary>
+/// Starts a frame. Until the matching ledmatrix_commit_frame(), the update,
+/// clear and flush functions only change the copy of the display, and the
+/// whole frame is then sent at once with the cheapest commands. Frames may
+/// be nested; only the outermost commit sends. The shift functions still
+/// send at once, after the pixels drawn so far.
+/// </summary>
+void ledmatrix_begin_frame(void);
+
+/// <summary>
+/// Ends a frame started by ledmatrix_begin_frame(), sending every pixel
+/// changed within it if this is the outermost frame.
+/// </summary>
+void ledmatrix_commit_frame(void);
+
+/// <summary>
+/// Blanks the LED matrix with a single clear command, but keeps the copy of
+/// the display, so that the next ledmatrix_flush() shows it again. Like the
+/// shift functions, this is sent at once, even within a frame.
+/// </summary>
+void ledmatrix_blank(void);
+
+//
+// SPI clock calibration. By default the matrix is driven at the system clock
+// divided by 128, which is slow but can never overrun the matrix. A faster
+// divider found by ledmatrix_calibrate() is saved in EEPROM and used by
+// init_ledmatrix() from then on.
+//
+
+/// <summary>
+/// Finds the fastest SPI clock divider at which the LED matrix reliably
+/// receives back to back full display updates, and saves it in EEPROM.
+/// Each divider from 2 upwards is tried by sending a few test frames and
+/// asking the caller whether the last one is shown correctly. The display is
+/// left blank.
+/// </summary>
+/// <param name="pattern_shown">Returns whether the matrix shows the given
+/// pattern.</param>
+/// <returns>The chosen divider.</returns>
+uint8_t ledmatrix_calibrate(bool (*pattern_shown)(MatrixData pattern));
+
+/// <summary>
+/// Gets the SPI clock divider in use. During calibration, this is the
+/// divider being tried.
+/// </summary>
+/// <returns>The divider.</returns>
+uint8_t ledmatrix_get_divider(void);
+
 //
 // Functions to operate on MatrixRow and MatrixColumn data structures.
 //
@@ -121,4 +203,40 @@ void set_matrix_column_to_colour(MatrixColumn matrix_column,
 /// <param name="colour">The colour.</param>
 void set_matrix_row_to_colour(MatrixRow matrix_row, PixelColour colour);
 
+//
+// SPI traffic statistics. Compiled in only when LEDMATRIX_STATS is defined
+// (e.g. with -DLEDMATRIX_STATS), so normal builds pay nothing for them.
+//
+
+#ifdef LEDMATRIX_STATS
+
+// The LED matrix command types that are counted.
+typedef enum
+{
+	LEDMATRIX_UPDATE_ALL,
+	LEDMATRIX_UPDATE_PIXEL,
+	LEDMATRIX_UPDATE_ROW,
+	LEDMATRIX_UPDATE_COL,
+	LEDMATRIX_SHIFT_DISPLAY,
+	LEDMATRIX_CLEAR_SCREEN,
+	LEDMATRIX_NUM_COMMANDS
+} LedMatrixCommand;
+
+typedef struct
+{
+	uint32_t commands[LEDMATRIX_NUM_COMMANDS];
+	uint32_t bytes[LEDMATRIX_NUM_COMMANDS];
+	// Totals from the SPI driver.
+	SpiStats spi;
+} LedMatrixStats;
+
+/// <summary>
+/// Gets the number of commands and bytes of each type sent to the LED matrix
+/// since start up, and the time spent sending them.
+/// </summary>
+/// <param name="stats">Receives the statistics.</param>
+void ledmatrix_get_stats(LedMatrixStats *stats);
+
+#endif /* LEDMATRIX_STATS */
+
 #endif /* LEDMATRIX_H_ */
@@ -0,0 +1,144 @@
+/*
+ * loopstats.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#ifdef LOOP_STATS
+
+#include "loopstats.h"
+#include <stdio.h>
+#include <stdint.h>
+#include "hal.h"
+#include "timer0.h"
+#include "terminalio.h"
+
+// Bucket n counts passes taking from 2^n up to (but not including) 2^(n+1)
+// timer 0 counts, except that bucket 0 also counts passes shorter than one
+// count and the last bucket counts everything longer.
+#define NUM_BUCKETS 16
+
+// Microseconds per timer 0 count.
+#define US_PER_PHASE (HAL_CYCLES_PER_PHASE / (HAL_CPU_HZ / 1000000UL))
+
+static uint16_t buckets[NUM_BUCKETS];
+static uint32_t longest_pass;
+static uint32_t pass_start;
+
+// Number of times each periodic task ran, how many of those were late by a
+// millisecond or more, and the latest it ran.
+static uint16_t deadline_runs[LOOP_NUM_DEADLINES];
+static uint16_t deadline_misses[LOOP_NUM_DEADLINES];
+static uint32_t deadline_worst_ms[LOOP_NUM_DEADLINES];
+
+// Gets the time in timer 0 counts. If the millisecond tick happens while the
+// count is being read, the count is read again.
+static uint32_t current_phase_time(void)
+{
+	uint32_t ms;
+	uint8_t phase;
+	do
+	{
+		ms = get_current_time();
+		phase = hal_tick_phase();
+	} while (ms != get_current_time());
+	return ms * HAL_TICK_PHASES + phase;
+}
+
+void loop_stats_reset(void)
+{
+	for (uint8_t i = 0; i < NUM_BUCKETS; i++)
+	{
+		buckets[i] = 0;
+	}
+	for (uint8_t i = 0; i < LOOP_NUM_DEADLINES; i++)
+	{
+		deadline_runs[i] = 0;
+		deadline_misses[i] = 0;
+		deadline_worst_ms[i] = 0;
+	}
+	longest_pass = 0;
+	pass_start = current_phase_time();
+}
+
+void loop_stats_resume(void)
+{
+	pass_start = current_phase_time();
+}
+
+void loop_stats_iteration(void)
+{
+	uint32_t now = current_phase_time();
+	uint32_t duration = now - pass_start;
+	pass_start = now;
+
+	uint8_t bucket = 0;
+	for (uint32_t d = duration; d > 1 && bucket < NUM_BUCKETS - 1; d >>= 1)
+	{
+		bucket++;
+	}
+	if (buckets[bucket] < UINT16_MAX)
+	{
+		buckets[bucket]++;
+	}
+	if (duration > longest_pass)
+	{
+		longest_pass = duration;
+	}
+}
+
+void loop_stats_deadline(LoopDeadline deadline, uint32_t late_ms)
+{
+	if (deadline_runs[deadline] < UINT16_MAX)
+	{
+		deadline_runs[deadline]++;
+	}
+	if (late_ms > 0 && deadline_misses[deadline] < UINT16_MAX)
+	{
+		deadline_misses[deadline]++;
+	}
+	if (late_ms > deadline_worst_ms[deadline])
+	{
+		deadline_worst_ms[deadline] = late_ms;
+	}
+}
+
+void loop_stats_print(int row, int col)
+{
+	move_terminal_cursor(row++, col);
+	printf_P(PSTR("LOOP PASSES (longest %lu us):"),
+		(unsigned long)(longest_pass * US_PER_PHASE));
+	for (uint8_t i = 0; i < NUM_BUCKETS; i++)
+	{
+		if (buckets[i] == 0)
+		{
+			continue;
+		}
+		move_terminal_cursor(row++, col);
+		unsigned long low = (i == 0) ? 0 : (1UL << i) * US_PER_PHASE;
+		if (i == NUM_BUCKETS - 1)
+		{
+			printf_P(PSTR("  >= %7lu us: %u"), low, buckets[i]);
+		}
+		else
+		{
+			printf_P(PSTR("  %7lu - %7lu us: %u"), low,
+				(2UL << i) * US_PER_PHASE, buckets[i]);
+		}
+	}
+	static const char deadline_names[LOOP_NUM_DEADLINES][13] PROGMEM =
+	{
+		"PLAYER FLASH", "TARGET FLASH"
+	};
+	for (uint8_t i = 0; i < LOOP_NUM_DEADLINES; i++)
+	{
+		char name[13];
+		memcpy_P(name, deadline_names[i], sizeof(name));
+		move_terminal_cursor(row++, col);
+		printf_P(PSTR("%s: %u runs, %u late, worst %lu ms late"), name,
+			deadline_runs[i], deadline_misses[i],
+			(unsigned long)deadline_worst_ms[i]);
+	}
+}
+
+#endif /* LOOP_STATS */
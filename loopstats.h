@@ -0,0 +1,79 @@
+/*
+ * loopstats.h
+ *
+ * Author: Jevi Waugh
+ *
+ * Main loop instrumentation. When the project is built with LOOP_STATS
+ * defined (e.g. with -DLOOP_STATS), play_game() records the duration of
+ * every pass of its loop in a histogram with power of two buckets, and how
+ * late the player and target flashes were. The results are printed on the
+ * game over screen. Without LOOP_STATS the macros below compile to nothing.
+ */
+
+#ifndef LOOPSTATS_H_
+#define LOOPSTATS_H_
+
+#include <stdint.h>
+
+// The periodic tasks of the main loop with a deadline.
+typedef enum
+{
+	LOOP_DEADLINE_PLAYER_FLASH,
+	LOOP_DEADLINE_TARGET_FLASH,
+	LOOP_NUM_DEADLINES
+} LoopDeadline;
+
+#ifdef LOOP_STATS
+
+#define LOOP_STATS_RESET() loop_stats_reset()
+#define LOOP_STATS_RESUME() loop_stats_resume()
+#define LOOP_STATS_ITERATION() loop_stats_iteration()
+#define LOOP_STATS_DEADLINE(deadline, late_ms) \
+	loop_stats_deadline((deadline), (late_ms))
+#define LOOP_STATS_PRINT(row, col) loop_stats_print((row), (col))
+
+/// <summary>
+/// Clears the histogram and the deadline statistics, and starts timing the
+/// first loop pass.
+/// </summary>
+void loop_stats_reset(void);
+
+/// <summary>
+/// Starts timing a new loop pass without recording the current one. Used
+/// after the game has been paused.
+/// </summary>
+void loop_stats_resume(void);
+
+/// <summary>
+/// Records the duration of the loop pass that has just finished and starts
+/// timing the next one. Called once at the top of each pass.
+/// </summary>
+void loop_stats_iteration(void);
+
+/// <summary>
+/// Records how late a periodic task ran.
+/// </summary>
+/// <param name="deadline">The task.</param>
+/// <param name="late_ms">Milliseconds between the task falling due and it
+/// running.</param>
+void loop_stats_deadline(LoopDeadline deadline, uint32_t late_ms);
+
+/// <summary>
+/// Prints the histogram and the deadline statistics, one line each, starting
+/// at the given terminal position.
+/// </summary>
+/// <param name="row">The terminal row of the first line.</param>
+/// <param name="col">The terminal column of every line.</param>
+void loop_stats_print(int row, int col);
+
+#else
+
+#define LOOP_STATS_RESET()
+#define LOOP_STATS_RESUME()
+#define LOOP_STATS_ITERATION()
+#define LOOP_STATS_DEADLINE(deadline, late_ms)
+#define LOOP_STATS_PRINT(row, col)
+
+#endif /* LOOP_STATS */
+
+#endif /* LOOPSTATS_H_ */
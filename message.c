@@ -0,0 +1,156 @@
+/*
+ * message.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#include "message.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hal.h"
+#include "terminalio.h"
+
+// Where the message area starts. It runs to the end of the line.
+#define MESSAGE_ROW 6
+#define MESSAGE_COL 44
+
+// Message text is copied out of program memory this many characters at a
+// time.
+#define MESSAGE_CHUNK 16
+
+typedef struct
+{
+	// The text, in program memory, and its length.
+	const char *text;
+	uint8_t length;
+	// A message replaces the one shown only if its priority is at least
+	// as high, or the one shown has expired.
+	uint8_t priority;
+	// How long the message is shown for, in milliseconds.
+	uint16_t lifetime;
+} MessageInfo;
+
+static const char hit_wall_text[] PROGMEM = "YOU'VE HIT A WALL!";
+static const char wall_enemy_text[] PROGMEM = "THE WALL IS AN ENEMY! BEWARE";
+static const char avoid_walls_text[] PROGMEM = "AVOID THE WALLS!";
+static const char blocked_by_wall_text[] PROGMEM = "There's a wall there mate!";
+static const char blocked_by_box_text[] PROGMEM =
+	"A box cannot be stacked on top of another box.";
+static const char blocked_by_target_text[] PROGMEM = "Target already placed";
+static const char box_moved_text[] PROGMEM = "Box moved successfully.";
+static const char box_off_target_text[] PROGMEM = "BOX MOVED FROM TARGET.";
+static const char box_on_target_text[] PROGMEM =
+	"You've put the box in the target";
+
+#define INFO(text, priority, lifetime) \
+	{ text, sizeof(text) - 1, priority, lifetime }
+
+static const MessageInfo messages[MESSAGE_NUM_IDS] PROGMEM =
+{
+	[MESSAGE_HIT_WALL] = INFO(hit_wall_text, 0, 2000),
+	[MESSAGE_WALL_ENEMY] = INFO(wall_enemy_text, 0, 2000),
+	[MESSAGE_AVOID_WALLS] = INFO(avoid_walls_text, 0, 2000),
+	[MESSAGE_BOX_BLOCKED_BY_WALL] = INFO(blocked_by_wall_text, 1, 2000),
+	[MESSAGE_BOX_BLOCKED_BY_BOX] = INFO(blocked_by_box_text, 1, 2000),
+	[MESSAGE_BOX_BLOCKED_BY_TARGET] = INFO(blocked_by_target_text, 1, 2000),
+	[MESSAGE_BOX_MOVED] = INFO(box_moved_text, 1, 2000),
+	[MESSAGE_BOX_OFF_TARGET] = INFO(box_off_target_text, 1, 2000),
+	[MESSAGE_BOX_ON_TARGET] = INFO(box_on_target_text, 2, 3000),
+};
+
+#undef INFO
+
+// The message to show, when it was last shown, and whether it has yet to
+// be sent.
+static MessageId current;
+static uint32_t shown_time;
+static bool send_pending;
+// The length of the text on the terminal, which is all that needs clearing.
+static uint8_t shown_length;
+
+static void get_info(MessageId id, MessageInfo *info)
+{
+	memcpy_P(info, &messages[id], sizeof(*info));
+}
+
+void message_reset(void)
+{
+	current = MESSAGE_NONE;
+	send_pending = false;
+	shown_length = 0;
+}
+
+MessageId message_current(void)
+{
+	return current;
+}
+
+void message_show(MessageId id, uint32_t now)
+{
+	if (id == current)
+	{
+		shown_time = now;
+		return;
+	}
+	MessageInfo info;
+	if (current != MESSAGE_NONE)
+	{
+		get_info(current, &info);
+		bool expired = now - shown_time >= info.lifetime;
+		uint8_t current_priority = info.priority;
+		get_info(id, &info);
+		if (info.priority < current_priority && !expired)
+		{
+			return;
+		}
+	}
+	current = id;
+	shown_time = now;
+	send_pending = true;
+}
+
+void message_update(uint32_t now)
+{
+	MessageInfo info;
+	if (current != MESSAGE_NONE && !send_pending)
+	{
+		get_info(current, &info);
+		if (now - shown_time >= info.lifetime)
+		{
+			current = MESSAGE_NONE;
+			send_pending = true;
+		}
+	}
+	if (!send_pending)
+	{
+		return;
+	}
+	send_pending = false;
+
+	move_terminal_cursor(MESSAGE_ROW, MESSAGE_COL);
+	normal_display_mode();
+	uint8_t length = 0;
+	if (current != MESSAGE_NONE)
+	{
+		get_info(current, &info);
+		char chunk[MESSAGE_CHUNK];
+		for (length = 0; length < info.length; length += MESSAGE_CHUNK)
+		{
+			uint8_t count = info.length - length;
+			if (count > MESSAGE_CHUNK)
+			{
+				count = MESSAGE_CHUNK;
+			}
+			memcpy_P(chunk, info.text + length, count);
+			terminal_write(chunk, count);
+		}
+		length = info.length;
+	}
+	if (length < shown_length)
+	{
+		// Clear what is left of the old message.
+		clear_to_end_of_line();
+	}
+	shown_length = length;
+}
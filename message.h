@@ -0,0 +1,63 @@
+/*
+ * message.h
+ *
+ * Author: Jevi Waugh
+ *
+ * The message area at the end of the status line, which tells the player
+ * what happened to their last move. Messages are referred to by ID and
+ * their text is kept in program memory. A message is sent only when it
+ * replaces a different one, and is cleared when it expires. A message
+ * cannot replace one of higher priority until that one has expired.
+ */
+
+#ifndef MESSAGE_H_
+#define MESSAGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+	MESSAGE_NONE,
+	// The player walked in to a wall. Any one of these is shown.
+	MESSAGE_HIT_WALL,
+	MESSAGE_WALL_ENEMY,
+	MESSAGE_AVOID_WALLS,
+	// A box could not be pushed.
+	MESSAGE_BOX_BLOCKED_BY_WALL,
+	MESSAGE_BOX_BLOCKED_BY_BOX,
+	MESSAGE_BOX_BLOCKED_BY_TARGET,
+	// A box was pushed.
+	MESSAGE_BOX_MOVED,
+	MESSAGE_BOX_OFF_TARGET,
+	MESSAGE_BOX_ON_TARGET,
+	MESSAGE_NUM_IDS
+} MessageId;
+
+/// <summary>
+/// Forgets the message shown, e.g. after the terminal has been cleared.
+/// </summary>
+void message_reset(void);
+
+/// <summary>
+/// Shows a message, from the next message_update(). Showing the message
+/// already shown only restarts its time, and nothing is sent. A message of
+/// lower priority than the one shown is ignored.
+/// </summary>
+/// <param name="id">The message.</param>
+/// <param name="now">The current time in milliseconds.</param>
+void message_show(MessageId id, uint32_t now);
+
+/// <summary>
+/// Returns the message shown, or MESSAGE_NONE.
+/// </summary>
+MessageId message_current(void);
+
+/// <summary>
+/// Clears the message shown if it has expired, and sends the message
+/// replacing it, if any.
+/// </summary>
+/// <param name="now">The current time in milliseconds.</param>
+void message_update(uint32_t now);
+
+#endif /* MESSAGE_H_ */
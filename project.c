@@ -11,15 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-
-#define F_CPU 8000000UL
-#include <util/delay.h>
-
+#include "hal.h"
 #include "game.h"
 #include "startscrn.h"
 #include "ledmatrix.h"
@@ -29,10 +24,24 @@
 #include "timer0.h"
 #include "timer1.h"
 #include "timer2.h"
+#include "isrtrace.h"
+#include "loopstats.h"
+#include "anim.h"
+#include "status.h"
+#include "message.h"
+#include "render.h"
 
 #define MILLISECONDS 1000
 int32_t level_time = 0;
 
+// The effect shown when a box is pushed on to a target: the squares around
+// it light up for half a second.
+static const AnimKeyframe box_on_target_anim[] PROGMEM =
+{
+	{ 500, ANIM_ALL_PIXELS, COLOUR_LIGHT_ORANGE },
+	{ 0, 0, COLOUR_BLACK }
+};
+
 
 // Function prototypes - these are defined below (after main()) in the order
 // given here.
@@ -41,6 +50,8 @@ void start_screen(void);
 void new_game(void);
 void play_game(void);
 void handle_game_over(void);
+void print_debug_stats(void);
+void calibrate_led_matrix(void);
 
 /////////////////////////////// main //////////////////////////////////
 int main(void)
@@ -117,13 +128,17 @@ void start_screen(void)
 			// breaking out of this loop.
 			if (serial_input == 's' || serial_input == 'S')
 			{
-				TCCR2B |= (0 << CS22) | (1 << CS21) | (1 <<CS20); // Divide clock by 8
+				hal_ssd_start(); // Divide clock by 8
 				break;
 			}
 			else if ((serial_input) == '2'){
 				level = 2;
 				break;
 			}
+			else if (serial_input == 'c' || serial_input == 'C')
+			{
+				calibrate_led_matrix();
+			}
 
 			
 		}
@@ -143,6 +158,8 @@ void new_game()
 	// Clear the serial terminal.
 	hide_cursor();
 	clear_terminal();
+	status_reset();
+	message_reset();
 
 	// Initialise the game and display.
 	initialise_game(level);
@@ -160,29 +177,31 @@ void play_game(void)
 
 	uint32_t last_flash_time = get_current_time();
 	uint32_t last_joystick_time = get_current_time();
-	uint32_t last_print_time = 0;
 	uint32_t start_time = get_current_time();  // Only record start time now
 	uint32_t last_target_flash_time = get_current_time();
-	last_target_area_flash_time = get_current_time();
 	bool game_paused = false;
 	// has not been tested yet.
 	game_muted = false;
     
-	DDRA |= (1 << 2) | (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7);
+	hal_gpio_a_output((1 << 2) | (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7));
 	// CLEAR ALL PINS
-	PORTA &= ~((1 << PD2) | (1 << PD3)) | ((1 << PD4) | (1 << PD5)) | ((1 << PD6) | (1 << PD7)); 
-	PORTA |= (1 << 2) | (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7);
+	hal_gpio_a_clear((1 << 2) | (1 << 3));
+	hal_gpio_a_set((1 << 2) | (1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7));
 	
 	steps_glob = 0;
 	//bool target_met = false;
-	bool anim_playing = false;
+	anim_reset(paint_matrix_square);
 	
 	// move_terminal_cursor(4,4);
     // printf_P(PSTR("Level: %d "), level);
 	
 	// We play the game until it's over.
+	// Until the game is over, the displays are updated by render frames.
+	render_begin(get_current_time());
+	LOOP_STATS_RESET();
 	while (!is_game_over())
 	{
+		LOOP_STATS_ITERATION();
 		// We need to check if any buttons have been pushed, this will
 		// be NO_BUTTON_PUSHED if no button has been pushed. If button
 		// 0 has been pushed, we get BUTTON0_PUSHED, and likewise, if
@@ -194,12 +213,7 @@ void play_game(void)
 		// level_time = ((last_flash_time / MILLISECONDS) % 60) + 1;
 		// // adding a one because we cant have o seconds displayed, but not sure if i should or not.
 		
-		if (level_time != last_print_time) {
-			move_terminal_cursor(6,26);
-            printf_P(PSTR("Time elapsed: %d "), level_time);
-			
-            last_print_time = level_time;
-        }
+		status_set(STATUS_TIME, level_time);
 		// elapsed_time = (get_current_time() - last_flash_time); // 200ms
 		
 		ButtonState btn = button_pushed();
@@ -251,12 +265,14 @@ void play_game(void)
 		
 		else if (toupper(serial_input) == 'P'){
 			game_paused = true;
+			// Show everything up to the pause.
+			render_flush();
 			// printf_P(PSTR("Time elapsed: %d "), level_time);
 			reset_cursor_position();
 			clear_to_end_of_line();
 			printf_P(PSTR("GAME PAUSED!"));
 			uint32_t game_pause_time = get_current_time();
-			uint8_t timer_setting = TCCR1B;
+			uint8_t timer_setting = hal_tone_save();
 			stop_tone();
 			// uint32_t last_game_pause_time = get_current_time();
 			// LAST FLASH TIME Thingi
@@ -279,9 +295,11 @@ void play_game(void)
 					printf_P(PSTR("GAME RESUMED!"));
 					start_time += get_current_time() - game_pause_time;
 					last_flash_time += get_current_time() - game_pause_time;
-					TCCR1B = timer_setting;
+					anim_postpone(get_current_time() - game_pause_time);
+					hal_tone_restore(timer_setting);
 					// LAST FLASH TIME Thingi
 					game_paused = false;
+					LOOP_STATS_RESUME();
 				}
 					
 			}
@@ -298,7 +316,7 @@ void play_game(void)
 				//PORTA &= ~(1 << (undo_capacity-4));
 			//}
 			undo_capacity = (undo_capacity + 1) % 6;
-			PORTA &= ~(1 << (undo_capacity+2));
+			hal_gpio_a_clear(1 << (undo_capacity+2));
 			
 			
 			
@@ -315,11 +333,23 @@ void play_game(void)
 			//}
 			
 		}
+		else if (toupper(serial_input) == 'I'){
+			// Debug statistics, below the game area.
+			print_debug_stats();
+		}
+#ifdef ISR_TRACE
+		else if (toupper(serial_input) == 'T'){
+			// Interrupt trace dump, below the game area.
+			isr_trace_dump();
+		}
+#endif
 		//else if(toupper(serial_input) == 'Z' && steps_glob == 0){
 			//printf_P(PSTR("You can't undo steps that you haven't made yet, sorry!"));
 		//}
 		uint32_t current_time = get_current_time();
 		if (current_time >= last_target_flash_time + 500){
+			LOOP_STATS_DEADLINE(LOOP_DEADLINE_TARGET_FLASH,
+				current_time - (last_target_flash_time + 500));
 			flash_target_square();
 			last_target_flash_time = current_time;
 		}
@@ -327,6 +357,8 @@ void play_game(void)
 		{
 			// 200ms (0.2 seconds) has passed since the last time
 			// we flashed the player icon, flash it now.
+			LOOP_STATS_DEADLINE(LOOP_DEADLINE_PLAYER_FLASH,
+				current_time - (last_flash_time + 200));
 			flash_player();
 
 			// Update the most recent icon flash time.
@@ -338,62 +370,22 @@ void play_game(void)
 		// printf("<!> shiftpost: %"PRIu32"    %"PRIu32"     ", current_time, last_target_area_flash_time);
 		// ::DEBUG
 		
-		uint16_t target_x;
-		uint16_t target_y;
+		// Light up the squares around a box pushed on to a target.
 		if (target_met && new_object_location == TARGET){
-			// printf_P(PSTR("testing"));
-			
-			target_x = new_object_x;
-			target_y = new_object_y;
 			target_met = false;
-			get_location_matrix(new_object_y, new_object_x);
-			last_target_area_flash_time = current_time;
-			anim_playing = true;
-
-			// target_met = false;
-		}
-		// fix squares not going away after moving.
-		
-		
-		if (anim_playing && current_time >= last_target_area_flash_time + 500)
-		{
-			// printf_P(PSTR("testing2 %d %d"), new_object_y, new_object_x);
-			// if (new_object_location == TARGET && target_met == true){
-			move_terminal_cursor(23, 0);
-			get_location_matrix2(target_y, target_x);
-			last_target_area_flash_time = current_time;
-			anim_playing = false;
-			// }
-			
+			anim_start(box_on_target_anim, new_object_y, new_object_x,
+				current_time);
 		}
+		anim_update(current_time);
 		
 		if (current_time >= last_joystick_time + 400){
-			// Set up ADC - AVCC reference, right adjust
-			// Input selection doesn't matter yet - we'll swap this around in the while
-			// // loop below.
-			ADMUX = (1<<REFS0);
-			// // Turn on the ADC (but don't start a conversion yet). Choose a clock
-			// // divider of 64. (The ADC clock must be somewhere
-			// // between 50kHz and 200kHz. We will divide our 8MHz clock by 64
-			// // to give us 125kHz.)
-			ADCSRA = (1<<ADEN)|(1<<ADPS2)|(1<<ADPS1);
-			// Set the ADC mux to choose ADC0 if x_or_y is 0, ADC1 if x_or_y is 1
-			ADMUX &= ~1;
-
-			// Start the ADC conversion
-			ADCSRA |= (1<<ADSC);
-			while(ADCSRA & (1<<ADSC)) {
-				; /* Wait until conversion finished */
-			}
-			joy_x = ADC;
-			ADMUX |= 1;
-						// Start the ADC conversion
-			ADCSRA |= (1<<ADSC);
-			while(ADCSRA & (1<<ADSC)) {
-				; /* Wait until conversion finished */
-			}
+			// Read the joystick - ADC0 is x and ADC1 is y. Each conversion
+			// uses the AVCC reference with the ADC clock at 8MHz / 64 = 125kHz
+			// (it must be somewhere between 50kHz and 200kHz) and blocks until
+			// it has finished.
+			joy_x = hal_adc_read(0);
 			// do the rest of the moves here
-			joy_y = ADC;
+			joy_y = hal_adc_read(1);
 			if (joy_x > 550 && joy_y > 550){
 				// top left
 				move_player(1, -1, true);
@@ -438,6 +430,9 @@ void play_game(void)
 			// // Next time through the loop, do the other direction
 			last_joystick_time = current_time;
 		}
+
+		// Send what changed on the displays, if a frame is due.
+		render_update(current_time);
 		 
 		// if (delta steps and move
 		// if (delta_steps > 0 and move_player is true)
@@ -449,6 +444,7 @@ void play_game(void)
 
 	}
 	// We get here if the game is over.
+	render_end();
 	// printf_P(PSTR("LEVEL COMPLETED"));
 }
 
@@ -480,6 +476,9 @@ void handle_game_over(void)
 	move_terminal_cursor(14, 10);
 	printf_P(PSTR("Press 'r'/'R' to restart, or 'e'/'E' to exit"));
 
+	// Main loop timing, if compiled in.
+	LOOP_STATS_PRINT(16, 10);
+
 	// Do nothing until a valid input is made.
 	while (1)
 	{
@@ -517,3 +516,105 @@ void handle_game_over(void)
 	
 	}
 }
+
+// Checks whether the LED matrix shows a calibration pattern. The host build
+// can look at the simulated matrix; on the board we have to ask.
+static bool calibration_pattern_shown(MatrixData pattern)
+{
+#ifdef HAL_HOST
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		for (uint8_t col = 0; col < MATRIX_NUM_COLUMNS; col++)
+		{
+			if (hal_host_pixel(row, col) != pattern[row][col])
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+#else
+	(void)pattern;
+	move_terminal_cursor(14, 5);
+	clear_to_end_of_line();
+	printf_P(PSTR("Divider %u: are there clean diagonal stripes of red, "
+		"green, yellow and orange? (y/n)"), ledmatrix_get_divider());
+	while (1)
+	{
+		int answer = toupper(fgetc(stdin));
+		if (answer == 'Y' || answer == 'N')
+		{
+			return answer == 'Y';
+		}
+	}
+#endif
+}
+
+// Finds the fastest reliable SPI clock for the LED matrix (see
+// ledmatrix_calibrate()) and restarts the start screen animation.
+void calibrate_led_matrix(void)
+{
+	move_terminal_cursor(13, 5);
+	clear_to_end_of_line();
+	printf_P(PSTR("Calibrating the LED matrix..."));
+	uint8_t divider = ledmatrix_calibrate(calibration_pattern_shown);
+	move_terminal_cursor(14, 5);
+	clear_to_end_of_line();
+	move_terminal_cursor(13, 5);
+	clear_to_end_of_line();
+	printf_P(PSTR("LED matrix SPI clock divider: %u (saved)"), divider);
+	setup_start_screen();
+	clear_serial_input_buffer();
+}
+
+// Prints the SRAM usage and whichever other debug statistics have been
+// compiled in, starting at the terminal row below the game area.
+void print_debug_stats(void)
+{
+	uint8_t row = 24;
+	uint16_t static_bytes = hal_sram_static_bytes();
+	uint16_t unused_bytes = hal_sram_unused_bytes();
+	move_terminal_cursor(row++, 0);
+	clear_to_end_of_line();
+	printf_P(PSTR("SRAM     : %u static, %u deepest stack, %u never used"),
+		static_bytes, HAL_SRAM_BYTES - static_bytes - unused_bytes,
+		unused_bytes);
+#ifdef LEDMATRIX_STATS
+	static const char command_names[LEDMATRIX_NUM_COMMANDS][6] PROGMEM =
+	{
+		"ALL", "PIXEL", "ROW", "COL", "SHIFT", "CLEAR"
+	};
+	LedMatrixStats stats;
+	ledmatrix_get_stats(&stats);
+	for (uint8_t type = 0; type < LEDMATRIX_NUM_COMMANDS; type++)
+	{
+		char name[6];
+		memcpy_P(name, command_names[type], sizeof(name));
+		move_terminal_cursor(row++, 0);
+		clear_to_end_of_line();
+		printf_P(PSTR("LED %-5s: %"PRIu32" cmds, %"PRIu32" bytes"), name,
+			stats.commands[type], stats.bytes[type]);
+	}
+	move_terminal_cursor(row++, 0);
+	clear_to_end_of_line();
+	printf_P(PSTR("LED SPI  : %"PRIu32" bytes, %"PRIu32" busy cycles, "
+		"%"PRIu32" full waits, high water %u"), stats.spi.bytes,
+		stats.spi.busy_cycles, stats.spi.full_waits, stats.spi.high_water);
+#endif
+#ifdef SERIALIO_STATS
+	SerialStats serial;
+	serial_get_stats(&serial);
+	move_terminal_cursor(row++, 0);
+	clear_to_end_of_line();
+	printf_P(PSTR("UART     : %"PRIu32" queued, %"PRIu32" sent, %"PRIu32
+		" dropped, %"PRIu32" blocked cycles, high water %u"),
+		serial.bytes_queued, serial.bytes_sent, serial.bytes_dropped,
+		serial.blocked_cycles, serial.high_water);
+	move_terminal_cursor(row++, 0);
+	clear_to_end_of_line();
+	printf_P(PSTR("UART frame: %u frames, last %u bytes, max %u bytes, "
+		"%u over %u byte budget"), serial.frames, serial.last_frame_bytes,
+		serial.max_frame_bytes, serial.frames_over_budget,
+		RENDER_FRAME_BYTE_BUDGET);
+#endif
+}
@@ -0,0 +1,57 @@
+/*
+ * render.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#include "render.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "ledmatrix.h"
+#include "terminalio.h"
+#include "serialio.h"
+#include "status.h"
+#include "message.h"
+#include "timer0.h"
+
+static uint32_t last_frame_time;
+
+// Sends the changes since the last frame. The LED matrix frame is kept
+// open between frames, so that nothing reaches the matrix in between.
+static void send_frame(uint32_t now, uint16_t byte_budget)
+{
+	serial_begin_frame();
+	ledmatrix_commit_frame();
+	ledmatrix_begin_frame();
+	status_flush();
+	message_update(now);
+	terminal_grid_flush(byte_budget);
+	serial_end_frame(byte_budget);
+}
+
+void render_begin(uint32_t now)
+{
+	last_frame_time = now;
+	ledmatrix_begin_frame();
+}
+
+void render_update(uint32_t now)
+{
+	if (now - last_frame_time < RENDER_INTERVAL_MS)
+	{
+		return;
+	}
+	last_frame_time = now;
+	send_frame(now, RENDER_FRAME_BYTE_BUDGET);
+}
+
+void render_flush(void)
+{
+	send_frame(get_current_time(), UINT16_MAX);
+}
+
+void render_end(void)
+{
+	send_frame(get_current_time(), UINT16_MAX);
+	ledmatrix_commit_frame();
+}
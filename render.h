@@ -0,0 +1,55 @@
+/*
+ * render.h
+ *
+ * Author: Jevi Waugh
+ *
+ * Batches the game's display output in to frames. While rendering, the game
+ * only changes the copies of the displays kept by the LED matrix, terminal
+ * grid, status line and message area modules, and render_update() sends
+ * what changed every RENDER_INTERVAL_MS. Changes made between two frames,
+ * such as several moves from keys repeating quickly, go out as one.
+ */
+
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include <stdint.h>
+
+// The time between frames, in milliseconds.
+#ifndef RENDER_INTERVAL_MS
+#define RENDER_INTERVAL_MS 20
+#endif
+
+// The number of bytes of board changes a frame sends to the terminal. The
+// rest are sent by the following frames. The default is about what the
+// UART sends at 19200 baud between two frames, so that the output buffer
+// does not fill up. (The status line and message area are small, and are
+// always sent whole.)
+#ifndef RENDER_FRAME_BYTE_BUDGET
+#define RENDER_FRAME_BYTE_BUDGET 40
+#endif
+
+/// <summary>
+/// Starts rendering. From now until render_end(), nothing is sent to the
+/// LED matrix or the terminal board except by render_update().
+/// </summary>
+/// <param name="now">The current time in milliseconds.</param>
+void render_begin(uint32_t now);
+
+/// <summary>
+/// Sends a frame if one is due.
+/// </summary>
+/// <param name="now">The current time in milliseconds.</param>
+void render_update(uint32_t now);
+
+/// <summary>
+/// Sends a frame now, with everything that changed.
+/// </summary>
+void render_flush(void);
+
+/// <summary>
+/// Sends everything that changed and stops rendering.
+/// </summary>
+void render_end(void);
+
+#endif /* RENDER_H_ */
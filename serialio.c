@@ -20,11 +20,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-
-// System clock rate in Hz. L at the end indicates this is a long constant.
-#define SYSCLK 8000000L
+#include "hal.h"
+#include "isrtrace.h"
 
 // Circular buffer to hold outgoing characters. The insert_pos variable keeps
 // track of the position (0 to OUTPUT_BUFFER_SIZE-1) that the next outgoing
@@ -53,11 +50,94 @@ volatile uint8_t input_overrun;
 // back or not.
 static bool do_echo;
 
+// Called before the next byte written to stdout (see serial_before_text()).
+static void (*before_text)(void);
+
+#ifdef SERIALIO_STATS
+// Transmit statistics (see serialio.h). Those updated by the ISR are only
+// read with interrupts disabled. blocked_phases counts timer 0 counts, each
+// HAL_CYCLES_PER_PHASE cycles long.
+static SerialStats stats;
+static uint32_t blocked_phases;
+static uint32_t frame_start;
+#endif
+
+// Waits until there is room for count more bytes in the output buffer.
+// Returns false (and counts the bytes as dropped) if the buffer is too full
+// and interrupts are disabled - the buffer will never be emptied if
+// interrupts are disabled. The bytes_in_buffer variable will get modified
+// by the ISR which extracts bytes from the buffer.
+static bool wait_for_room(uint8_t count, bool interrupts_enabled)
+{
+#ifdef SERIALIO_STATS
+	// Each pass of the loop below is far shorter than a millisecond, so
+	// the timer 0 count wraps around at most once between two reads.
+	uint8_t last_phase = hal_tick_phase();
+#endif
+	while (bytes_in_out_buffer > OUTPUT_BUFFER_SIZE - count)
+	{
+		if (!interrupts_enabled)
+		{
+#ifdef SERIALIO_STATS
+			stats.bytes_dropped += count;
+#endif
+			return false;
+		}
+		hal_poll();
+#ifdef SERIALIO_STATS
+		uint8_t phase = hal_tick_phase();
+		blocked_phases += (uint8_t)(phase + HAL_TICK_PHASES - last_phase) %
+			HAL_TICK_PHASES;
+		last_phase = phase;
+#endif
+	}
+	return true;
+}
+
+// Adds bytes to the output buffer, which must have room for them, and makes
+// sure the UART will send them. Must be called with interrupts disabled.
+static void queue_bytes(const char *data, uint8_t count)
+{
+	// We advance the insert_pos to the next character position. If this
+	// is beyond the end of the buffer, we wrap around back to the
+	// beginning of the buffer.
+	for (uint8_t i = 0; i < count; i++)
+	{
+		out_buffer[out_insert_pos++] = data[i];
+		if (out_insert_pos == OUTPUT_BUFFER_SIZE)
+		{
+			out_insert_pos = 0;
+		}
+	}
+	bytes_in_out_buffer += count;
+	hal_uart_queued(data, count);
+#ifdef SERIALIO_STATS
+	stats.bytes_queued += count;
+	if (bytes_in_out_buffer > stats.high_water)
+	{
+		stats.high_water = bytes_in_out_buffer;
+	}
+#endif
+
+	// Reenable the UDR Empty interrupt (it may have been disabled) so
+	// that it will fire and deal with the next character in the buffer.
+	hal_uart_enable_tx_interrupt();
+}
+
 static int uart_put_char(char c, FILE *stream)
 {
 	// Add the character to the buffer for transmission (if there is space
 	// to do so). If not we wait until the buffer has space.
 
+	// Let whoever asked get the terminal ready for text. Echoed
+	// characters (with no stream) are not text written by the program.
+	if (before_text && stream)
+	{
+		void (*hook)(void) = before_text;
+		before_text = NULL;
+		hook();
+	}
+
 	// If the character is linefeed, we output carriage return.
 	if (c == '\n')
 	{
@@ -65,40 +145,19 @@ static int uart_put_char(char c, FILE *stream)
 	}
 
 	// If the buffer is full and interrupts are disabled then we abort -
-	// we don't output the character since the buffer will never be
-	// emptied if interrupts are disabled. If the buffer is full and
-	// interrupts are enabled, then we loop until the buffer has enough
-	// space. The bytes_in_buffer variable will get modified by the ISR
-	// which extracts bytes from the buffer.
-	bool interrupts_enabled = bit_is_set(SREG, SREG_I);
-	while (bytes_in_out_buffer >= OUTPUT_BUFFER_SIZE)
+	// we don't output the character. If the buffer is full and interrupts
+	// are enabled, then we loop until the buffer has enough space.
+	bool interrupts_enabled = hal_interrupts_enabled();
+	if (!wait_for_room(1, interrupts_enabled))
 	{
-		if (!interrupts_enabled)
-		{
-			return 1;
-		}
+		return 1;
 	}
 
-	// Add the character to the buffer for transmission if there is space
-	// to do so. We advance the insert_pos to the next character position.
-	// If this is beyond the end of the buffer, we wrap around back to the
-	// beginning of the buffer. NOTE: We disable interrupts before
-	// modifying the buffer. This prevents the ISR from modifying the
-	// buffer at the same time. We reenable them if they were enabled when
-	// we entered the function.
+	// NOTE: We disable interrupts before modifying the buffer. This
+	// prevents the ISR from modifying the buffer at the same time. We
+	// reenable them if they were enabled when we entered the function.
 	cli();
-	out_buffer[out_insert_pos++] = c;
-	bytes_in_out_buffer++;
-	if (out_insert_pos == OUTPUT_BUFFER_SIZE)
-	{
-		// Wrap around buffer pointer if necessary.
-		out_insert_pos = 0;
-	}
-
-	// Reenable interrupts (UDR Empty interrupt may have been disabled) -
-	// we ensure it is now enabled so that it will fire and deal with the
-	// next character in the buffer.
-	UCSR0B |= (1 << UDRIE0);
+	queue_bytes(&c, 1);
 	if (interrupts_enabled)
 	{
 		sei();
@@ -111,14 +170,14 @@ static int uart_get_char(FILE *stream)
 	// Wait until we've received a character.
 	while (bytes_in_input_buffer == 0)
 	{
-		// Do nothing.
+		hal_poll();
 	}
 
 	// Turn interrupts off and remove a character from the input buffer.
 	// We reenable interrupts if they were on. The pending character is
 	// the one which is byte_in_input_buffer characters before the insert
 	// position (taking into account that we may need to wrap around).
-	uint8_t interrupts_enabled = bit_is_set(SREG, SREG_I);
+	uint8_t interrupts_enabled = hal_interrupts_enabled();
 	cli();
 	char c;
 	if (input_insert_pos - bytes_in_input_buffer < 0)
@@ -174,14 +233,11 @@ static int uart_get_char(FILE *stream)
 	return c;
 }
 
-// File stream which performs I/O using the UART. Used as stdio and stdout.
-static FILE serialio = FDEV_SETUP_STREAM(uart_put_char, uart_get_char,
-	_FDEV_SETUP_RW);
-
 // Interrupt handler for UART Data Register Empty (i.e., another character
 // can be taken from our buffer and written out).
 ISR(USART0_UDRE_vect)
 {
+	ISR_TRACE_ENTER(ISR_TRACE_USART_UDRE);
 	// Check if we have data in our buffer.
 	if (bytes_in_out_buffer > 0)
 	{
@@ -206,7 +262,10 @@ ISR(USART0_UDRE_vect)
 		bytes_in_out_buffer--;
 
 		// Output the character via the UART.
-		UDR0 = c;
+		hal_uart_write(c);
+#ifdef SERIALIO_STATS
+		stats.bytes_sent++;
+#endif
 	}
 	else
 	{
@@ -214,16 +273,18 @@ ISR(USART0_UDRE_vect)
 		// Empty interrupt because otherwise it will trigger again
 		// immediately when this ISR exits. The interrupt is reenabled
 		// when a character is placed in the buffer.
-		UCSR0B &= ~(1 << UDRIE0);
+		hal_uart_disable_tx_interrupt();
 	}
+	ISR_TRACE_EXIT(ISR_TRACE_USART_UDRE);
 }
 
 // Interrupt handler for UART Receive Complete (i.e., can read a character).
 // The character is read and placed in the input buffer.
 ISR(USART0_RX_vect)
 {
+	ISR_TRACE_ENTER(ISR_TRACE_USART_RX);
 	// Read the character - we ignore the possibility of overrun.
-	char c = UDR0;
+	char c = hal_uart_read();
 
 	if (do_echo && bytes_in_out_buffer < OUTPUT_BUFFER_SIZE)
 	{
@@ -257,6 +318,7 @@ ISR(USART0_RX_vect)
 			input_insert_pos = 0;
 		}
 	}
+	ISR_TRACE_EXIT(ISR_TRACE_USART_RX);
 }
 
 void init_serial_stdio(long baudrate, bool echo)
@@ -271,29 +333,24 @@ void init_serial_stdio(long baudrate, bool echo)
 	// Record whether we're going to echo characters or not.
 	do_echo = echo;
 
-	// Configure the baud rate. This differs from the datasheet formula so
-	// that we get rounding to the nearest integer while using integer
-	// division (which truncates).
-	UBRR0 = (uint16_t)((((SYSCLK / (8 * baudrate)) + 1) / 2) - 1);
-
-	// Enable transmission and receiving via UART. We don't enable the UDR
-	// empty interrupt here (we wait until we've got a character to
-	// transmit). NOTE: Interrupts must be enabled globally for this
-	// module to work, but we do not do this here.
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
-
-	// Enable receive complete interrupt.
-	UCSR0B |= (1 << RXCIE0);
+	// Configure the baud rate, enable transmission and receiving and the
+	// receive complete interrupt. We don't enable the UDR empty interrupt
+	// here (we wait until we've got a character to transmit). NOTE:
+	// Interrupts must be enabled globally for this module to work, but we
+	// do not do this here.
+	hal_uart_init(baudrate);
 
 	// Set up our stream so the get and put functions are used to
 	// read/write characters via the serial port when we use stdio
-	// functions.
-	stdout = &serialio;
-	stdin = &serialio;
+	// functions. The stream is used as stdio and stdout.
+	FILE *serialio = hal_uart_stream(uart_put_char, uart_get_char);
+	stdout = serialio;
+	stdin = serialio;
 }
 
 bool serial_input_available(void)
 {
+	hal_poll();
 	return bytes_in_input_buffer != 0;
 }
 
@@ -303,3 +360,78 @@ void clear_serial_input_buffer(void)
 	input_insert_pos = 0;
 	bytes_in_input_buffer = 0;
 }
+
+bool serial_write(const char *data, uint8_t length)
+{
+	// Like uart_put_char(), but all of the bytes go in to the buffer
+	// together, with a single critical section. Line feeds are not
+	// translated. Any length fits once the buffer has emptied.
+	bool interrupts_enabled = hal_interrupts_enabled();
+	if (!wait_for_room(length, interrupts_enabled))
+	{
+		return false;
+	}
+	cli();
+	queue_bytes(data, length);
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+	return true;
+}
+
+void serial_before_text(void (*hook)(void))
+{
+	before_text = hook;
+}
+
+#ifdef SERIALIO_STATS
+void serial_get_stats(SerialStats *result)
+{
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	*result = stats;
+	result->blocked_cycles = blocked_phases * HAL_CYCLES_PER_PHASE;
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+}
+
+void serial_begin_frame(void)
+{
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	frame_start = stats.bytes_queued;
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+}
+
+void serial_end_frame(uint16_t byte_budget)
+{
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	uint32_t bytes = stats.bytes_queued - frame_start;
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+	if (bytes == 0)
+	{
+		// Nothing changed since the last frame.
+		return;
+	}
+	stats.last_frame_bytes = (bytes > UINT16_MAX) ? UINT16_MAX : bytes;
+	if (stats.last_frame_bytes > stats.max_frame_bytes)
+	{
+		stats.max_frame_bytes = stats.last_frame_bytes;
+	}
+	stats.frames++;
+	if (bytes > byte_budget)
+	{
+		stats.frames_over_budget++;
+	}
+}
+#endif
@@ -36,4 +36,79 @@ bool serial_input_available(void);
 /// </summary>
 void clear_serial_input_buffer(void);
 
+/// <summary>
+/// Sends bytes to the serial port, like fwrite() to stdout, but puts them all
+/// in the output buffer at once. Waits until there is room for all of them,
+/// unless interrupts are disabled, in which case the bytes are discarded if
+/// they do not fit.
+/// </summary>
+/// <param name="data">The bytes to send.</param>
+/// <param name="length">The number of bytes.</param>
+/// <returns>Whether the bytes were sent; false if they were discarded.</returns>
+bool serial_write(const char *data, uint8_t length);
+
+/// <summary>
+/// Sets a function to be called once, just before the next byte is written
+/// to stdout (e.g. by printf() or putchar()). Bytes sent with serial_write()
+/// do not call it, so the function may use serial_write(). A later call
+/// replaces the function, and NULL removes it.
+/// </summary>
+/// <param name="hook">The function to call.</param>
+void serial_before_text(void (*hook)(void));
+
+//
+// Transmit statistics. Compiled in only when SERIALIO_STATS is defined (e.g.
+// with -DSERIALIO_STATS). Otherwise the frame functions compile to nothing.
+//
+
+#ifdef SERIALIO_STATS
+
+typedef struct
+{
+	// Bytes put in the output buffer and bytes written to the UART.
+	uint32_t bytes_queued;
+	uint32_t bytes_sent;
+	// Bytes discarded because the buffer was full with interrupts off.
+	uint32_t bytes_dropped;
+	// CPU cycles spent waiting for room in a full output buffer.
+	uint32_t blocked_cycles;
+	// The most bytes ever waiting in the output buffer.
+	uint8_t high_water;
+	// Bytes queued by the last render frame, the most queued by any
+	// frame, the number of frames, and the number of frames which queued
+	// more than their byte budget. Frames that queued nothing are not
+	// counted.
+	uint16_t last_frame_bytes;
+	uint16_t max_frame_bytes;
+	uint16_t frames;
+	uint16_t frames_over_budget;
+} SerialStats;
+
+/// <summary>
+/// Gets the transmit statistics since start up.
+/// </summary>
+/// <param name="stats">Receives the statistics.</param>
+void serial_get_stats(SerialStats *stats);
+
+/// <summary>
+/// Marks the start of a render frame (see render.h). The bytes queued from
+/// now until serial_end_frame() are charged to the frame.
+/// </summary>
+void serial_begin_frame(void);
+
+/// <summary>
+/// Marks the end of a render frame and checks it against its byte budget.
+/// A frame that queued nothing is not counted.
+/// </summary>
+/// <param name="byte_budget">The bytes the frame was meant to send, e.g.
+/// RENDER_FRAME_BYTE_BUDGET.</param>
+void serial_end_frame(uint16_t byte_budget);
+
+#else
+
+#define serial_begin_frame()
+#define serial_end_frame(byte_budget)
+
+#endif /* SERIALIO_STATS */
+
 #endif /* SERIALIO_H_ */
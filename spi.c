@@ -5,66 +5,200 @@
  */
 
 #include "spi.h"
-#include <avr/io.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal.h"
+#include "isrtrace.h"
+
+// Circular buffer of bytes waiting to be sent. queue_insert_pos is the
+// position the next byte is written to, and the bytes_in_queue bytes before
+// it are waiting. A byte is removed from the queue when its transfer starts;
+// transmitting is set while a transfer is in progress.
+static volatile uint8_t queue[SPI_QUEUE_SIZE];
+static volatile uint8_t queue_insert_pos;
+static volatile uint8_t bytes_in_queue;
+static volatile bool transmitting;
+
+#ifdef LEDMATRIX_STATS
+// Statistics. busy_phases counts timer 0 counts (HAL_CYCLES_PER_PHASE cycles
+// each) spent waiting.
+static volatile uint32_t bytes_sent;
+static uint32_t busy_phases;
+static uint32_t full_waits;
+static uint8_t high_water;
+#endif
 
 void spi_setup_master(uint8_t clockdivider)
 {
-	// Make the SS, MOSI and SCK pins outputs. These are pins 4, 5 and 7
-	// of port B on the ATmega324A.
-	DDRB |= (1 << DDB7) | (1 << DDB5) | (1 << DDB4);
+	// This is called again when the game restarts, maybe with a transfer
+	// still in progress. Writing the data register during a transfer is a
+	// collision that loses the byte, so let the queue empty first. Before
+	// the first set up the queue is empty and this returns at once.
+	spi_wait();
+
+	// The register set up (SS, MOSI and SCK outputs, master mode and the
+	// clock divider) is done by the hardware abstraction layer.
+	hal_spi_init(clockdivider);
+
+	queue_insert_pos = 0;
+	bytes_in_queue = 0;
+	transmitting = false;
+	hal_spi_enable_interrupt();
+}
+
+void spi_set_clock_divider(uint8_t clockdivider)
+{
+	spi_wait();
+	hal_spi_init(clockdivider);
+	hal_spi_enable_interrupt();
+}
+
+// Called when a transfer has completed: starts the next queued byte, if
+// any. Must be called with interrupts disabled.
+static void send_next(void)
+{
+#ifdef LEDMATRIX_STATS
+	bytes_sent++;
+#endif
+	if (bytes_in_queue == 0)
+	{
+		transmitting = false;
+		return;
+	}
+	uint8_t pos;
+	if (queue_insert_pos < bytes_in_queue)
+	{
+		// Need to wrap around.
+		pos = queue_insert_pos - bytes_in_queue + SPI_QUEUE_SIZE;
+	}
+	else
+	{
+		pos = queue_insert_pos - bytes_in_queue;
+	}
+	bytes_in_queue--;
+	hal_spi_write(queue[pos]);
+}
+
+// Interrupt handler for SPI Serial Transfer Complete.
+ISR(SPI_STC_vect)
+{
+	ISR_TRACE_ENTER(ISR_TRACE_SPI);
+	send_next();
+	ISR_TRACE_EXIT(ISR_TRACE_SPI);
+}
 
-	// Set the slave select (SS) line high.
-	PORTB |= (1 << PORTB4);
-	
-	// Set up the SPI control registers SPCR and SPSR. Enable SPI as use
-	// Master Mode by setting the SPE and MSTR bits of SPCR0.
-	SPCR0 = (1 << SPE0) | (1 << MSTR0);
-	
-	// Set SPR0 and SPR1 bits in SPCR and SPI2X bit in SPSR based on the
-	// given clock divider. Invalid values default to the slowest speed.
-	// We consider each bit in turn.
-	switch (clockdivider)
+// Waits while the queue holds more than the given number of bytes and, if
+// until_idle is set, until the last transfer has finished. With interrupts
+// enabled the interrupt handler drains the queue, otherwise it is drained
+// here by polling the transfer complete flag.
+static void wait_for_queue(uint8_t limit, bool until_idle)
+{
+#ifdef LEDMATRIX_STATS
+	// Each pass of the loop below is far shorter than a millisecond, so
+	// the timer 0 count wraps around at most once between two reads.
+	uint8_t last_phase = hal_tick_phase();
+#endif
+	while (bytes_in_queue > limit || (until_idle && transmitting))
 	{
-		case 2: // Fallthrough.
-		case 8: // Fallthrough.
-		case 32:
-			SPSR0 = (1 << SPI2X0);
-			break;
-		default:
-			SPSR0 = 0;
-			break;
+		if (hal_interrupts_enabled())
+		{
+			hal_poll();
+		}
+		else
+		{
+			(void)hal_spi_wait();
+			send_next();
+		}
+#ifdef LEDMATRIX_STATS
+		uint8_t phase = hal_tick_phase();
+		busy_phases += (uint8_t)(phase + HAL_TICK_PHASES - last_phase) %
+			HAL_TICK_PHASES;
+		last_phase = phase;
+#endif
 	}
-	switch (clockdivider)
+}
+
+void spi_queue_byte(uint8_t byte)
+{
+	if (bytes_in_queue >= SPI_QUEUE_SIZE)
 	{
-		case 128:
-			SPCR0 |= (1 << SPR00);
-			// Fallthrough.
-		case 32: // Fallthrough.
-		case 64:
-			SPCR0 |= (1 << SPR10);
-			break;
-		case 8: // Fallthrough.
-		case 16:
-			SPCR0 |= (1 << SPR00);
-			break;
+		// Back pressure: wait for room.
+#ifdef LEDMATRIX_STATS
+		full_waits++;
+#endif
+		wait_for_queue(SPI_QUEUE_SIZE - 1, false);
 	}
 
-	// Take SS (slave select) line low.
-	PORTB &= ~(1 << PORTB4);
+	// We disable interrupts while changing the queue, so that the
+	// interrupt handler does not change it at the same time.
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	if (!transmitting)
+	{
+		// Idle - start the transfer straight away.
+		transmitting = true;
+		hal_spi_write(byte);
+	}
+	else
+	{
+		queue[queue_insert_pos++] = byte;
+		bytes_in_queue++;
+		if (queue_insert_pos == SPI_QUEUE_SIZE)
+		{
+			// Wrap around buffer pointer if necessary.
+			queue_insert_pos = 0;
+		}
+#ifdef LEDMATRIX_STATS
+		if (bytes_in_queue > high_water)
+		{
+			high_water = bytes_in_queue;
+		}
+#endif
+	}
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+}
+
+void spi_wait(void)
+{
+	wait_for_queue(0, true);
 }
 
 uint8_t spi_send_byte(uint8_t byte)
 {
-	// Write out the byte to the SPDR0 register. This will initiate the
-	// transfer. We then wait until the most significant bit of SPSR0
-	// (SPIF0) is set - this indicates that the transfer is complete. The
-	// final read of SPSR0 followed by a read of SPDR0 will cause the SPIF
-	// bit to be reset to 0. See page 173 of the ATmega324A datasheet for
-	// more info.
-	SPDR0 = byte;
-	while ((SPSR0 & (1 << SPIF0)) == 0)
+	// Send anything queued, then transfer this byte with interrupts
+	// disabled so that we can wait for it and read the reply. Blocks for 8
+	// cycles of the divided clock until the transfer is complete. See page
+	// 173 of the ATmega324A datasheet for more info.
+	spi_wait();
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	hal_spi_write(byte);
+	uint8_t result = hal_spi_wait();
+#ifdef LEDMATRIX_STATS
+	bytes_sent++;
+#endif
+	if (interrupts_enabled)
+	{
+		sei();
+	}
+	return result;
+}
+
+#ifdef LEDMATRIX_STATS
+void spi_get_stats(SpiStats *stats)
+{
+	bool interrupts_enabled = hal_interrupts_enabled();
+	cli();
+	stats->bytes = bytes_sent;
+	if (interrupts_enabled)
 	{
-		; // Wait.
+		sei();
 	}
-	return SPDR0;
+	stats->busy_cycles = busy_phases * HAL_CYCLES_PER_PHASE;
+	stats->full_waits = full_waits;
+	stats->high_water = high_water;
 }
+#endif
@@ -15,19 +15,74 @@
 
 /// <summary>
 /// Sets up SPI communication as a master. This function must be called
-/// before any of the SPI functions can be used. This function should only
-/// be called once.
+/// before any of the SPI functions can be used. If it is called again, it
+/// first waits until every queued byte has been sent.
 /// </summary>
 /// <param name="clockdivider">The clock divider, should be one of 2, 4, 8,
 /// 16, 32, 64, 128.</param>
 void spi_setup_master(uint8_t clockdivider);
 
 /// <summary>
-/// Sends and receives an SPI byte. This function will take at least 8 
-/// cycles of the divided clock (i.e. will busy wait).
+/// Changes the SPI clock divider, once every queued byte has been sent.
+/// </summary>
+/// <param name="clockdivider">The clock divider, should be one of 2, 4, 8,
+/// 16, 32, 64, 128.</param>
+void spi_set_clock_divider(uint8_t clockdivider);
+
+/// <summary>
+/// Sends and receives an SPI byte. Any queued bytes are sent first. This
+/// function will take at least 8 cycles of the divided clock (i.e. will
+/// busy wait).
 /// </summary>
 /// <param name="byte">The byte to send.</param>
 /// <returns>The byte received.</returns>
 uint8_t spi_send_byte(uint8_t byte);
 
+//
+// Non-blocking transmission. Bytes are queued and sent, in order, from the
+// SPI transfer complete interrupt, so the caller does not wait for them.
+//
+
+// The number of bytes that can be queued. Enough for a whole LED matrix
+// update (129 bytes) plus a couple of pixel updates.
+#ifndef SPI_QUEUE_SIZE
+#define SPI_QUEUE_SIZE 136
+#endif
+
+/// <summary>
+/// Queues a byte for transmission. Returns immediately unless the queue is
+/// full, in which case it waits for room. If interrupts are disabled, the
+/// queue is drained by polling.
+/// </summary>
+/// <param name="byte">The byte to send.</param>
+void spi_queue_byte(uint8_t byte);
+
+/// <summary>
+/// Waits until every queued byte has been sent.
+/// </summary>
+void spi_wait(void);
+
+#ifdef LEDMATRIX_STATS
+
+typedef struct
+{
+	// Bytes sent.
+	uint32_t bytes;
+	// CPU cycles spent waiting, for room in the queue or for it to empty.
+	uint32_t busy_cycles;
+	// Number of bytes that found the queue full.
+	uint32_t full_waits;
+	// The most bytes ever waiting in the queue.
+	uint8_t high_water;
+} SpiStats;
+
+/// <summary>
+/// Gets the transmission statistics since start up. Only available when
+/// built with LEDMATRIX_STATS.
+/// </summary>
+/// <param name="stats">Receives the statistics.</param>
+void spi_get_stats(SpiStats *stats);
+
+#endif /* LEDMATRIX_STATS */
+
 #endif /* SPI_H_ */
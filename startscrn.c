@@ -9,7 +9,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 #include "pixel_colour.h"
 #include "ledmatrix.h"
 #include "terminalio.h"
@@ -21,94 +21,147 @@
 #define STATIC_TIME 	(1000)
 #define SCROLL_SPEED	(200)
 
-// Short colour definitions.
-#define G	(COLOUR_GREEN)
-#define O	(COLOUR_ORANGE)
-#define D	(COLOUR_DARK_GREEN)
-#define _	(COLOUR_BLACK)
+// The colours used by the start screen animation. Each pixel of the
+// animation is stored as a 2-bit index into this palette.
+static const PixelColour anim_palette[4] PROGMEM =
+{
+	COLOUR_BLACK, COLOUR_GREEN, COLOUR_ORANGE, COLOUR_DARK_GREEN
+};
+
+// Short palette index definitions.
+#define _	(0U)
+#define G	(1U)
+#define O	(2U)
+#define D	(3U)
+
+// Packs the palette indices of a column's pixels, from row 0 up, into 16
+// bits. The packing is done by the compiler, so the art stays readable.
+#define COLUMN(p0, p1, p2, p3, p4, p5, p6, p7) \
+	(uint16_t)((p0) | (p1) << 2 | (p2) << 4 | (p3) << 6 | (p4) << 8 | \
+	(p5) << 10 | (p6) << 12 | (p7) << 14)
 
-// The animation data for the start screen. It is an array of MatrixColumns,
-// with the 0th element being the left-most column of the start screen and the
-// last element being the right-most column of the start screen. It must have
-// at least MATRIX_NUM_COLUMN elements.
-const MatrixColumn anim_data[] PROGMEM =
+// The animation data for the start screen. It is an array of packed
+// columns (see COLUMN), with the 0th element being the left-most column of
+// the start screen and the last element being the right-most column of the
+// start screen. It must have at least MATRIX_NUM_COLUMN elements.
+static const uint16_t anim_data[] PROGMEM =
 {
-	{ G, G, _, G, G, G, G, _ },
-	{ G, _, _, G, _, _, G, _ },
-	{ G, _, _, G, _, _, G, _ },
-	{ G, G, G, G, _, G, G, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ G, _, _, _, G, _, _, _ },
-	{ G, _, _, _, G, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, G, G, G, G, _ },
-	{ _, _, _, G, _, _, _, _ },
-	{ _, _, G, _, G, _, _, _ },
-	{ G, G, _, _, _, G, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ G, _, _, _, G, _, _, _ },
-	{ G, _, _, _, G, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, G, G, G, G, _ },
-	{ G, _, _, G, _, _, _, _ },
-	{ G, _, _, G, _, _, _, _ },
-	{ G, G, G, G, _, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, _, G, _, _, _ },
-	{ G, _, G, _, G, _, _, _ },
-	{ G, _, G, _, G, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ _, _, _, _, G, _, _, _ },
-	{ _, _, _, _, G, _, _, _ },
-	{ G, G, G, G, G, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ O, O, O, O, O, O, _, _ },
-	{ O, O, _, _, O, O, _, _ },
-	{ O, _, O, O, _, O, _, _ },
-	{ O, _, O, O, _, O, _, _ },
-	{ O, O, _, _, O, O, _, _ },
-	{ O, O, O, O, O, O, _, _ },
-	{ _, _, _, D, _, D, _, _ },
-	{ D, _, _, D, _, D, _, _ },
-	{ _, D, _, _, D, _, D, D },
-	{ _, _, D, D, _, D, D, D },
-	{ _, D, _, _, _, _, D, D },
-	{ D, _, _, _, _, _, _, _ },
-	{ _, _, _, _, _, _, _, _ },
-	{ _, _, _, _, _, _, _, _ }
+	COLUMN(G, G, _, G, G, G, G, _),
+	COLUMN(G, _, _, G, _, _, G, _),
+	COLUMN(G, _, _, G, _, _, G, _),
+	COLUMN(G, G, G, G, _, G, G, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(G, _, _, _, G, _, _, _),
+	COLUMN(G, _, _, _, G, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, G, G, G, G, _),
+	COLUMN(_, _, _, G, _, _, _, _),
+	COLUMN(_, _, G, _, G, _, _, _),
+	COLUMN(G, G, _, _, _, G, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(G, _, _, _, G, _, _, _),
+	COLUMN(G, _, _, _, G, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, G, G, G, G, _),
+	COLUMN(G, _, _, G, _, _, _, _),
+	COLUMN(G, _, _, G, _, _, _, _),
+	COLUMN(G, G, G, G, _, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, _, G, _, _, _),
+	COLUMN(G, _, G, _, G, _, _, _),
+	COLUMN(G, _, G, _, G, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(_, _, _, _, G, _, _, _),
+	COLUMN(_, _, _, _, G, _, _, _),
+	COLUMN(G, G, G, G, G, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(O, O, O, O, O, O, _, _),
+	COLUMN(O, O, _, _, O, O, _, _),
+	COLUMN(O, _, O, O, _, O, _, _),
+	COLUMN(O, _, O, O, _, O, _, _),
+	COLUMN(O, O, _, _, O, O, _, _),
+	COLUMN(O, O, O, O, O, O, _, _),
+	COLUMN(_, _, _, D, _, D, _, _),
+	COLUMN(D, _, _, D, _, D, _, _),
+	COLUMN(_, D, _, _, D, _, D, D),
+	COLUMN(_, _, D, D, _, D, D, D),
+	COLUMN(_, D, _, _, _, _, D, D),
+	COLUMN(D, _, _, _, _, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _),
+	COLUMN(_, _, _, _, _, _, _, _)
 };
 
-// Undefine the short colour definitions.
+// Undefine the short palette index definitions.
 #undef G
 #undef O
 #undef D
 #undef _
+#undef COLUMN
+
+// The terminal ASCII art, 64 columns wide, as runs of cells of the same
+// colour along each line. Each line's runs end with a run of length 0, and
+// the blank cells at the end of a line are left out. The colour of a cell
+// depends on its column, so the letters are striped. The table is generated
+// from the art as a bitmap and the columns of the colour changes, which are
+// kept in tools/title_spans.py; after changing them there, replace the body
+// of title_spans with the output of
+//
+//   tools/title_spans.py
+typedef struct
+{
+	uint8_t attribute;
+	uint8_t length;
+} TitleSpan;
+
+#define TITLE_LINES 5
+
+// The longest run.
+#define TITLE_MAX_SPAN 7
 
-// Terminal ASCII art data bits. Each element in this array represents a line
-// of the ASCII art. The ASCII art has a width of 64 characters, and each bit
-// in the unsigned 64-bit integer represents a column/pixel.
-static const uint64_t title_data[] PROGMEM =
+// Short definitions of the run colours, used to make the art below easier to
+// read. _ is a run of blank cells.
+#define _(n)	{ TERM_RESET, (n) }
+#define M(n)	{ BG_MAGENTA, (n) }
+#define G(n)	{ BG_GREEN, (n) }
+#define B(n)	{ BG_BLUE, (n) }
+#define Y(n)	{ BG_YELLOW, (n) }
+#define R(n)	{ BG_RED, (n) }
+#define W(n)	{ BG_WHITE, (n) }
+#define C(n)	{ BG_CYAN, (n) }
+#define END 	{ TERM_RESET, 0 }
+
+static const TitleSpan title_spans[] PROGMEM =
 {
-	0b1111111001111110011000110011111100111111000111110011100001100000,
-	0b1100000011000011011001100110000110110001101100011011110001100000,
-	0b1111111011000011011111000110000110111111001111111011011001100000,
-	0b0000011011000011011001100110000110110001101100011011001101100000,
-	0b1111111001111110011000110011111100111111001100011011000111100000
+	M(7), _(2), G(6), _(2), B(2), _(3), B(2), _(2), Y(6), _(2), R(6), _(3),
+	W(5), _(2), C(3), _(4), C(2), END,
+	M(2), _(6), G(2), _(4), G(2), _(1), B(2), _(2), B(2), _(2), Y(2), _(4),
+	Y(2), _(1), R(2), _(3), R(2), _(1), W(2), _(3), W(2), _(1), C(4), _(3),
+	C(2), END,
+	M(7), _(1), G(2), _(4), G(2), _(1), B(5), _(3), Y(2), _(4), Y(2), _(1),
+	R(6), _(2), W(7), _(1), C(2), _(1), C(2), _(2), C(2), END,
+	_(5), M(2), _(1), G(2), _(4), G(2), _(1), B(2), _(2), B(2), _(2), Y(2),
+	_(4), Y(2), _(1), R(2), _(3), R(2), _(1), W(2), _(3), W(2), _(1), C(2),
+	_(2), C(2), _(1), C(2), END,
+	M(7), _(2), G(6), _(2), B(2), _(3), B(2), _(2), Y(6), _(2), R(6), _(2),
+	W(2), _(3), W(2), _(1), C(2), _(3), C(4), END,
 };
 
-// The colour definitions for the ASCII terminal title art. The positions
-// represent the columns which colour changes occur (highest to lowest), and
-// each position has a corresponding terminal attribute.
-const uint8_t title_pos[] = { 58, 48, 40, 32, 23, 15, 6 };
-const DisplayParameter title_attr[] = { BG_CYAN, BG_WHITE, BG_RED,
-	BG_YELLOW, BG_BLUE, BG_GREEN, BG_MAGENTA };
+#undef _
+#undef M
+#undef G
+#undef B
+#undef Y
+#undef R
+#undef W
+#undef C
+#undef END
 
 // For course staff: Code and defintions blow this point should not be
 // modified unless the operation of the start screen is to be changed.
@@ -141,16 +194,32 @@ static uint8_t next_column;
 // Macro for getting next column number.
 #define GET_NEXT_COLUMN(x, d) (((x) + 1) % countof((d)))
 
-// Displays the initial image of the start screen.
+// Unpacks a column of the start screen.
+static void decode_column(uint8_t index, MatrixColumn column_data)
+{
+	uint16_t packed = pgm_read_word(&anim_data[index]);
+	for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+	{
+		column_data[row] = pgm_read_byte(&anim_palette[packed & 0x03]);
+		packed >>= 2;
+	}
+}
+
+// Displays the initial image of the start screen, sending it with the
+// cheapest commands.
 static void display_initial_image(void)
 {
 	for (uint8_t col = 0; col < min(MATRIX_NUM_COLUMNS,
 		countof(anim_data)); col++)
 	{
 		MatrixColumn column_data;
-		memcpy_P(column_data, &anim_data[col], sizeof(column_data));
-		ledmatrix_update_column(col, column_data);
+		decode_column(col, column_data);
+		for (uint8_t row = 0; row < MATRIX_NUM_ROWS; row++)
+		{
+			ledmatrix_draw_pixel(row, col, column_data[row]);
+		}
 	}
+	ledmatrix_flush();
 }
 
 // Displays the next column of the start screen.
@@ -158,7 +227,7 @@ static void display_next_column(void)
 {
 	ledmatrix_shift_display_left();
 	MatrixColumn column_data;
-	memcpy_P(column_data, &anim_data[next_column], sizeof(column_data));
+	decode_column(next_column, column_data);
 	ledmatrix_update_column(MATRIX_NUM_COLUMNS - 1, column_data);
 	next_column = GET_NEXT_COLUMN(next_column, anim_data);
 	if (next_column == MATRIX_NUM_COLUMNS)
@@ -200,8 +269,9 @@ void update_start_screen(void)
 			flashing_start_time + FLASH_TIME)
 		{
 			// One second has passed since the start of flashing,
-			// turn off flashing.
-			display_initial_image();
+			// turn off flashing. The display still holds the initial
+			// image, so this only resends it if it is blanked.
+			ledmatrix_flush();
 			flags |= FLG_IS_FLASH_DONE;
 			last_update_time = time;
 		}
@@ -212,11 +282,11 @@ void update_start_screen(void)
 			// matrix.
 			if ((flags ^= FLG_TOGGLE_ON) & FLG_TOGGLE_ON)
 			{
-				ledmatrix_clear();
+				ledmatrix_blank();
 			}
 			else
 			{
-				display_initial_image();
+				ledmatrix_flush();
 			}
 			last_update_time = time;
 		}
@@ -231,46 +301,31 @@ void update_start_screen(void)
 	}
 }
 
-static bool display_title_pixel(uint8_t line, uint8_t col, bool coloured)
+void display_terminal_title(uint8_t row, uint8_t col)
 {
-	uint64_t data;
-	memcpy_P(&data, &title_data[line], sizeof(data));
-	if (data & ((uint64_t)1U << (63 - col)))
+	// The title is drawn on a cleared terminal, so the blank runs are
+	// skipped over rather than printed. Each coloured run is then one
+	// cursor move (usually a short relative one), a colour change if the
+	// colour differs from the last run's, and the spaces.
+	char spaces[TITLE_MAX_SPAN];
+	memset(spaces, ' ', sizeof(spaces));
+	const TitleSpan *next = title_spans;
+	for (uint8_t line = 0; line < TITLE_LINES; line++)
 	{
-		if (!coloured)
+		uint8_t span_col = col;
+		TitleSpan span;
+		memcpy_P(&span, next++, sizeof(span));
+		while (span.length)
 		{
-			for (uint8_t j = 0; j < countof(title_pos); j++)
+			if (span.attribute != TERM_RESET)
 			{
-				if (col <= title_pos[j])
-				{
-					set_display_attribute(title_attr[j]);
-				}
+				move_terminal_cursor(row + line, span_col);
+				set_display_attribute(span.attribute);
+				terminal_write(spaces, span.length);
 			}
-			coloured = true;
-		}
-	}
-	else
-	{
-		if (coloured)
-		{
-			normal_display_mode();
-			coloured = false;
-		}
-		
-	}
-	putchar(' ');
-	return coloured;
-}
-
-void display_terminal_title(uint8_t row, uint8_t col)
-{
-	bool coloured = false;
-	for (uint8_t line = 0; line < countof(title_data); line++)
-	{
-		move_terminal_cursor(line + row, col);
-		for (uint8_t i = 0; i < 64; i++)
-		{
-			coloured = display_title_pixel(line, i, coloured);
+			span_col += span.length;
+			memcpy_P(&span, next++, sizeof(span));
 		}
 	}
+	normal_display_mode();
 }
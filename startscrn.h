@@ -26,7 +26,8 @@ void setup_start_screen(void);
 void update_start_screen(void);
 
 /// <summary>
-/// Draws the terminal title ASCII art.
+/// Draws the terminal title ASCII art. The terminal must have been cleared,
+/// as the blank cells of the art are not drawn.
 /// </summary>
 /// <param name="row">The start row of the ASCII art.</param>
 /// <param name="col">The start column of the ASCII art.</param>
@@ -0,0 +1,139 @@
+/*
+ * status.c
+ *
+ * Author: Jevi Waugh
+ */
+
+#include "status.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hal.h"
+#include "terminalio.h"
+
+// The terminal row of the status line.
+#define STATUS_ROW 6
+
+// The longest label and the widest field.
+#define MAX_LABEL_LENGTH 14
+#define MAX_FIELD_WIDTH 4
+
+typedef struct
+{
+	// The terminal column of the label.
+	uint8_t col;
+	// The label, in program memory.
+	const char *label;
+	// The number of characters of the label, after which the number is
+	// shown.
+	uint8_t label_length;
+	// The number of characters of the number.
+	uint8_t width;
+	// The largest value that fits.
+	uint16_t max_value;
+} StatusLayout;
+
+static const char level_label[] PROGMEM = "Level: ";
+static const char steps_label[] PROGMEM = "STEPS: ";
+static const char time_label[] PROGMEM = "Time elapsed: ";
+
+// The fields end before the next one starts, and the time (columns 40 to
+// 43) before the message area at column 44.
+static const StatusLayout layouts[STATUS_NUM_FIELDS] PROGMEM =
+{
+	[STATUS_LEVEL] = { 4, level_label, 7, 2, 99 },
+	[STATUS_STEPS] = { 15, steps_label, 7, 4, 9999 },
+	[STATUS_TIME] = { 26, time_label, 14, 4, 9999 },
+};
+
+typedef struct
+{
+	// The value to show, and whether it has been set since the last
+	// status_reset().
+	uint16_t value;
+	bool set;
+	// Whether the label is on the terminal, and the number shown after it
+	// (space padded).
+	bool shown;
+	char text[MAX_FIELD_WIDTH];
+} StatusFieldState;
+
+static StatusFieldState fields[STATUS_NUM_FIELDS];
+
+void status_reset(void)
+{
+	memset(fields, 0, sizeof(fields));
+}
+
+void status_set(StatusField field, uint16_t value)
+{
+	fields[field].value = value;
+	fields[field].set = true;
+}
+
+// Writes a number left-aligned in a field, padded with spaces.
+static void format_number(char *text, uint8_t width, uint16_t value)
+{
+	char digits[5];
+	uint8_t count = 0;
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	for (uint8_t i = 0; i < width; i++)
+	{
+		text[i] = (i < count) ? digits[count - 1 - i] : ' ';
+	}
+}
+
+void status_flush(void)
+{
+	for (uint8_t i = 0; i < STATUS_NUM_FIELDS; i++)
+	{
+		StatusFieldState *field = &fields[i];
+		if (!field->set)
+		{
+			continue;
+		}
+		StatusLayout layout;
+		memcpy_P(&layout, &layouts[i], sizeof(layout));
+		char text[MAX_FIELD_WIDTH];
+		format_number(text, layout.width, (field->value < layout.max_value) ?
+			field->value : layout.max_value);
+
+		uint8_t first = 0;
+		uint8_t end = layout.width;
+		if (!field->shown)
+		{
+			char label[MAX_LABEL_LENGTH];
+			memcpy_P(label, layout.label, layout.label_length);
+			move_terminal_cursor(STATUS_ROW, layout.col);
+			normal_display_mode();
+			terminal_write(label, layout.label_length);
+			field->shown = true;
+		}
+		else
+		{
+			// Only the characters from the first to the last that
+			// changed.
+			while (first < end && text[first] == field->text[first])
+			{
+				first++;
+			}
+			while (end > first && text[end - 1] == field->text[end - 1])
+			{
+				end--;
+			}
+			if (first == end)
+			{
+				continue;
+			}
+		}
+		move_terminal_cursor(STATUS_ROW,
+			layout.col + layout.label_length + first);
+		normal_display_mode();
+		terminal_write(&text[first], end - first);
+		memcpy(field->text, text, layout.width);
+	}
+}
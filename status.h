@@ -0,0 +1,48 @@
+/*
+ * status.h
+ *
+ * Author: Jevi Waugh
+ *
+ * The status line above the game board: the level, the number of steps and
+ * the time elapsed. Each field is a label followed by a fixed-width,
+ * left-aligned number. Values are recorded as they change and sent by
+ * status_flush(), which rewrites only the characters that differ from what
+ * the terminal shows, so the line never needs clearing.
+ */
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <stdint.h>
+
+typedef enum
+{
+	STATUS_LEVEL,
+	STATUS_STEPS,
+	STATUS_TIME,
+	STATUS_NUM_FIELDS
+} StatusField;
+
+/// <summary>
+/// Forgets what the terminal shows, e.g. after it has been cleared. No field
+/// is shown until it is next given a value.
+/// </summary>
+void status_reset(void);
+
+/// <summary>
+/// Sets the value of a field, to be sent by the next status_flush(). Values
+/// too wide for the field are shown as the largest value that fits: 99 for
+/// the level, and 9999 for the steps and the time (in seconds).
+/// </summary>
+/// <param name="field">The field to set.</param>
+/// <param name="value">The new value.</param>
+void status_set(StatusField field, uint16_t value);
+
+/// <summary>
+/// Sends the changes to the status line since the last flush: a field's
+/// label the first time it is shown, and otherwise only the characters of
+/// its number that changed.
+/// </summary>
+void status_flush(void);
+
+#endif /* STATUS_H_ */
@@ -7,37 +7,333 @@
 #include "terminalio.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
+#include "serialio.h"
+
+// The grid cells, two to a byte (the low nibble is the even column). Each
+// nibble holds what the cell is to show: 0 for the default background, or
+// 1 + (colour - BG_BLACK). Bit col of grid_dirty[row] is set while the cell
+// shows something else.
+static uint8_t grid[TERM_GRID_ROWS][TERM_GRID_COLUMNS / 2];
+static uint16_t grid_dirty[TERM_GRID_ROWS];
+static uint8_t grid_row;
+static uint8_t grid_col;
+
+// The usual length of a select graphic rendition sequence setting a
+// background colour, ESC [ 4 n m.
+#define GRID_SGR_LENGTH 5
+
+// The escape sequences below are written straight to the serial output
+// buffer, rather than formatted with printf_P(). The longest is a cursor
+// move, ESC [ row ; col H.
+#define MAX_SEQUENCE_LENGTH 14
+
+// The display attributes in effect on the terminal, so that attributes
+// already in effect are not sent again. shown_fg and shown_bg are 0 for the
+// default colours, and bit n of shown_modes is set for mode n (TERM_BRIGHT
+// to TERM_HIDDEN). Nothing is known until the first reset is sent.
+static bool attributes_known;
+static uint8_t shown_fg;
+static uint8_t shown_bg;
+static uint16_t shown_modes;
+
+// Set when the attributes have been reset but the reset has not been sent.
+// It is sent just before the next text (see serial_before_text()) or
+// anything else that needs the default attributes, or is merged with the
+// next attribute set, or dropped if that attribute makes it unnecessary.
+static bool reset_pending;
+
+// The number of bytes sent with send_bytes(), which wraps around. The grid
+// flush uses it to keep to its byte budget.
+static uint16_t bytes_sent;
+
+// Where the cursor is, when it is known. It is known after a cursor move,
+// and kept up to date as the grid cells are printed, but any other text
+// (through stdout) could move it anywhere.
+static bool cursor_known;
+static uint8_t cursor_row;
+static uint8_t cursor_col;
+
+// Writes the decimal digits of a number and returns the number written.
+static uint8_t encode_decimal(char *p, uint16_t value)
+{
+	char digits[5];
+	uint8_t count = 0;
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	for (uint8_t i = 0; i < count; i++)
+	{
+		p[i] = digits[count - 1 - i];
+	}
+	return count;
+}
+
+// Writes a relative cursor motion ESC [ count final, with the count left
+// out if it is 1, and returns its length.
+static uint8_t encode_motion(char *p, uint8_t count, char final)
+{
+	uint8_t length = 0;
+	p[length++] = '\x1b';
+	p[length++] = '[';
+	if (count != 1)
+	{
+		length += encode_decimal(&p[length], count);
+	}
+	p[length++] = final;
+	return length;
+}
+
+static void send_pending_reset(void);
+
+// Called by serialio before text is written to stdout.
+static void text_written(void)
+{
+	cursor_known = false;
+	send_pending_reset();
+}
+
+// Asks serialio to call text_written() before the next text, if there is
+// anything it needs to do.
+static void update_text_hook(void)
+{
+	serial_before_text((cursor_known || reset_pending) ? text_written : NULL);
+}
+
+// Returns false if the bytes were discarded (see serial_write()), in which
+// case the terminal is left in a state that is not known.
+static bool send_bytes(const char *data, uint8_t length)
+{
+	if (!serial_write(data, length))
+	{
+		cursor_known = false;
+		attributes_known = false;
+		update_text_hook();
+		return false;
+	}
+	bytes_sent += length;
+	return true;
+}
 
 void move_terminal_cursor(int row, int col)
 {
-    printf_P(PSTR("\x1b[%d;%dH"), row + 1, col + 1);
+	// Two candidate sequences: an absolute move, and (if the cursor
+	// position is known) relative moves, which are shorter for short
+	// distances. The shorter is sent.
+	char absolute[MAX_SEQUENCE_LENGTH];
+	char relative[MAX_SEQUENCE_LENGTH];
+	uint8_t absolute_length = 0;
+	uint8_t relative_length = MAX_SEQUENCE_LENGTH;
+	if (cursor_known)
+	{
+		if (row == cursor_row && col == cursor_col)
+		{
+			return;
+		}
+		relative_length = 0;
+		if (col == 0 && cursor_col != 0)
+		{
+			relative[relative_length++] = '\r';
+		}
+		else if (col > cursor_col)
+		{
+			relative_length += encode_motion(&relative[relative_length],
+				col - cursor_col, 'C');
+		}
+		else if (col < cursor_col)
+		{
+			relative_length += encode_motion(&relative[relative_length],
+				cursor_col - col, 'D');
+		}
+		if (row > cursor_row)
+		{
+			relative_length += encode_motion(&relative[relative_length],
+				row - cursor_row, 'B');
+		}
+		else if (row < cursor_row)
+		{
+			relative_length += encode_motion(&relative[relative_length],
+				cursor_row - row, 'A');
+		}
+	}
+
+	// ESC [ row ; col H, leaving out the column if it is the first, and
+	// both if it is the top left corner.
+	absolute[absolute_length++] = '\x1b';
+	absolute[absolute_length++] = '[';
+	if (row != 0 || col != 0)
+	{
+		absolute_length += encode_decimal(&absolute[absolute_length],
+			row + 1);
+	}
+	if (col != 0)
+	{
+		absolute[absolute_length++] = ';';
+		absolute_length += encode_decimal(&absolute[absolute_length],
+			col + 1);
+	}
+	absolute[absolute_length++] = 'H';
+
+	bool sent;
+	if (relative_length < absolute_length)
+	{
+		sent = send_bytes(relative, relative_length);
+	}
+	else
+	{
+		sent = send_bytes(absolute, absolute_length);
+	}
+	if (sent)
+	{
+		cursor_known = true;
+		cursor_row = row;
+		cursor_col = col;
+		update_text_hook();
+	}
 }
 
 void normal_display_mode(void)
 {
-	printf_P(PSTR("\x1b[0m"));
+	set_display_attribute(TERM_RESET);
 }
 
 void reverse_video(void)
 {
-	printf_P(PSTR("\x1b[7m"));
+	set_display_attribute(TERM_REVERSE);
 }
 
 void clear_terminal(void)
 {
 	printf_P(PSTR("\x1b[2J"));
+	memset(grid, 0, sizeof(grid));
+	memset(grid_dirty, 0, sizeof(grid_dirty));
+}
+
+// Sends a select graphic rendition sequence setting an attribute, preceded
+// by a reset if reset is true. A TERM_RESET attribute sends just the reset.
+static void send_attribute(bool reset, DisplayParameter parameter)
+{
+	char sequence[MAX_SEQUENCE_LENGTH];
+	uint8_t length = 0;
+	sequence[length++] = '\x1b';
+	sequence[length++] = '[';
+	if (reset || parameter == TERM_RESET)
+	{
+		sequence[length++] = '0';
+		if (parameter != TERM_RESET)
+		{
+			sequence[length++] = ';';
+		}
+	}
+	if (parameter != TERM_RESET)
+	{
+		length += encode_decimal(&sequence[length], parameter);
+	}
+	sequence[length++] = 'm';
+	if (!send_bytes(sequence, length))
+	{
+		return;
+	}
+	if (reset || parameter == TERM_RESET)
+	{
+		attributes_known = true;
+		shown_fg = 0;
+		shown_bg = 0;
+		shown_modes = 0;
+	}
+	if (parameter >= FG_BLACK && parameter <= FG_WHITE)
+	{
+		shown_fg = parameter;
+	}
+	else if (parameter >= BG_BLACK && parameter <= BG_WHITE)
+	{
+		shown_bg = parameter;
+	}
+	else if (parameter != TERM_RESET)
+	{
+		shown_modes |= 1U << parameter;
+	}
+}
+
+static void send_pending_reset(void)
+{
+	if (reset_pending)
+	{
+		reset_pending = false;
+		update_text_hook();
+		send_attribute(true, TERM_RESET);
+	}
+}
+
+// Whether an attribute is already in effect.
+static bool attribute_shown(DisplayParameter parameter)
+{
+	if (parameter >= FG_BLACK && parameter <= FG_WHITE)
+	{
+		return shown_fg == parameter;
+	}
+	if (parameter >= BG_BLACK && parameter <= BG_WHITE)
+	{
+		return shown_bg == parameter;
+	}
+	return shown_modes & (1U << parameter);
 }
 
 void clear_to_end_of_line(void)
 {
-	printf_P(PSTR("\x1b[K"));
+	// The line is cleared to the current background colour.
+	send_pending_reset();
+	send_bytes("\x1b[K", 3);
 }
 
 void set_display_attribute(DisplayParameter parameter)
 {
-	printf_P(PSTR("\x1b[%dm"), parameter);
+	if (!attributes_known)
+	{
+		// Start from a known state.
+		send_attribute(true, parameter);
+		return;
+	}
+	if (parameter == TERM_RESET)
+	{
+		if (shown_fg || shown_bg || shown_modes)
+		{
+			reset_pending = true;
+			update_text_hook();
+		}
+		return;
+	}
+	bool reset = false;
+	if (reset_pending)
+	{
+		// The reset is only needed if it would undo more than the new
+		// attribute replaces.
+		bool is_fg = parameter >= FG_BLACK && parameter <= FG_WHITE;
+		bool is_bg = parameter >= BG_BLACK && parameter <= BG_WHITE;
+		reset = shown_modes || (shown_fg && !is_fg) || (shown_bg && !is_bg);
+		reset_pending = false;
+		update_text_hook();
+	}
+	if (!reset && attribute_shown(parameter))
+	{
+		return;
+	}
+	send_attribute(reset, parameter);
+}
+
+void terminal_write(const char *text, uint8_t length)
+{
+	// Written here rather than through stdout, so that the cursor
+	// position stays known.
+	send_pending_reset();
+	if (send_bytes(text, length))
+	{
+		cursor_col += length;
+	}
 }
 
 void hide_cursor(void)
@@ -107,3 +403,134 @@ void draw_vertical_line(int col, int start_row, int end_row)
 	// Reset the mode to normal.
 	normal_display_mode();
 }
+
+void terminal_grid_init(uint8_t row, uint8_t col)
+{
+	grid_row = row;
+	grid_col = col;
+}
+
+static uint8_t get_cell(uint8_t row, uint8_t col)
+{
+	uint8_t cells = grid[row][col / 2];
+	return (col & 1) ? cells >> 4 : cells & 0x0F;
+}
+
+void terminal_grid_set_cell(uint8_t row, uint8_t col,
+	DisplayParameter background)
+{
+	if (row >= TERM_GRID_ROWS || col >= TERM_GRID_COLUMNS)
+	{
+		return;
+	}
+	uint8_t cell = (background >= BG_BLACK && background <= BG_WHITE) ?
+		background - BG_BLACK + 1 : 0;
+	if (cell == get_cell(row, col))
+	{
+		return;
+	}
+	uint8_t *cells = &grid[row][col / 2];
+	if (col & 1)
+	{
+		*cells = (*cells & 0x0F) | (cell << 4);
+	}
+	else
+	{
+		*cells = (*cells & 0xF0) | cell;
+	}
+	// Setting a cell back to what it shows leaves a needless (but
+	// harmless) resend, which is rare enough not to track.
+	grid_dirty[row] |= 1U << col;
+}
+
+// Prints the grid cells of a row from col up to (but not including) end,
+// starting at the cursor.
+static void print_cells(uint8_t row, uint8_t col, uint8_t end)
+{
+	for (; col < end; col++)
+	{
+		uint8_t cell = get_cell(row, col);
+		set_display_attribute(cell ? BG_BLACK + cell - 1 : TERM_RESET);
+		terminal_write(" ", 1);
+	}
+}
+
+// Returns roughly how many more bytes it takes to reprint the unchanged
+// cells of a row from col up to (but not including) end, between the
+// changed cells before and at end, than to move the cursor past them.
+static int8_t reprint_cost(uint8_t row, uint8_t col, uint8_t end)
+{
+	// The move is ESC [ count C, with a count of 1 left out.
+	int8_t cost = (int8_t)(end - col) - ((end - col == 1) ? 3 : 4);
+	uint8_t before = get_cell(row, col - 1);
+	uint8_t shown = before;
+	for (; col <= end; col++)
+	{
+		uint8_t cell = get_cell(row, col);
+		if (cell != shown)
+		{
+			cost += GRID_SGR_LENGTH;
+			shown = cell;
+		}
+	}
+	// The colour change from before to end is needed either way.
+	if (shown != before)
+	{
+		cost -= GRID_SGR_LENGTH;
+	}
+	return cost;
+}
+
+bool terminal_grid_flush(uint16_t byte_budget)
+{
+	uint16_t start = bytes_sent;
+	bool first_run = true;
+	for (uint8_t row = 0; row < TERM_GRID_ROWS; row++)
+	{
+		uint16_t dirty = grid_dirty[row];
+		grid_dirty[row] = 0;
+		uint8_t col = 0;
+		while (dirty)
+		{
+			// Skip to the next changed cell, then take in the changed
+			// cells after it for as long as reprinting the cells in
+			// between is no longer than moving the cursor past them.
+			// A whole row that changed is sent after one cursor move,
+			// with a colour change only where the colour changes.
+			while (!(dirty & (1U << col)))
+			{
+				col++;
+			}
+			if (!first_run && (uint16_t)(bytes_sent - start) >= byte_budget)
+			{
+				// Out of budget. The rest of the changes are sent
+				// by the next flush.
+				grid_dirty[row] = dirty;
+				set_display_attribute(TERM_RESET);
+				return false;
+			}
+			first_run = false;
+			dirty &= ~(1U << col);
+			uint8_t end = col + 1;
+			while (dirty)
+			{
+				uint8_t next = end;
+				while (!(dirty & (1U << next)))
+				{
+					next++;
+				}
+				if (next != end && reprint_cost(row, end, next) > 0)
+				{
+					break;
+				}
+				dirty &= ~(1U << next);
+				end = next + 1;
+			}
+			move_terminal_cursor(grid_row + row, grid_col + col);
+			print_cells(row, col, end);
+			col = end;
+		}
+	}
+	set_display_attribute(TERM_RESET);
+	return true;
+}
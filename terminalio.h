@@ -11,6 +11,7 @@
 #define TERMINAL_IO_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /*
 	Column number and row number are measured relative to the top
@@ -57,14 +58,17 @@ typedef enum
 
 /// <summary>
 /// Moves the terminal cursor to a new location. Row and column numbers use
-/// 0-based indexing.
+/// 0-based indexing. When the cursor position is known, the shortest of an
+/// absolute move, relative moves and a carriage return is sent, and nothing
+/// if the cursor is already there.
 /// </summary>
 /// <param name="row">The new row number of the terminal cursor.</param>
 /// <param name="col">The new column number of the terminal cursor.</param>
 void move_terminal_cursor(int row, int col);
 
 /// <summary>
-/// Resets the terminal display mode.
+/// Resets the terminal display mode. The reset is only sent when something
+/// that needs it is (see set_display_attribute()).
 /// </summary>
 void normal_display_mode(void);
 
@@ -74,7 +78,7 @@ void normal_display_mode(void);
 void reverse_video(void);
 
 /// <summary>
-/// Clears the terminal.
+/// Clears the terminal. The grid cells then show the default background.
 /// </summary>
 void clear_terminal(void);
 
@@ -84,11 +88,23 @@ void clear_terminal(void);
 void clear_to_end_of_line(void);
 
 /// <summary>
-/// Sets a display attribute.
+/// Sets a display attribute. Nothing is sent if the attribute is already in
+/// effect. A reset (TERM_RESET) is held back until text is written, a line
+/// or the screen is cleared, or another attribute is set, and is left out
+/// altogether if that attribute replaces everything it would reset.
 /// </summary>
 /// <param name="parameter">The display attribute to set.</param>
 void set_display_attribute(DisplayParameter parameter);
 
+/// <summary>
+/// Writes text at the cursor. Unlike text written through stdout, this
+/// keeps the cursor position known, so later cursor moves can be shorter.
+/// </summary>
+/// <param name="text">The text, which must be printable characters that
+/// fit on the rest of the line.</param>
+/// <param name="length">The number of characters.</param>
+void terminal_write(const char *text, uint8_t length);
+
 /// <summary>
 /// Hides the blinking terminal cursor from the user.
 /// </summary>
@@ -147,4 +163,43 @@ void draw_horizontal_line(int row, int start_col, int end_col);
 /// <param name="end_row">The end row of the line, inclusive.</param>
 void draw_vertical_line(int col, int start_row, int end_row);
 
+// The board grid: a block of TERM_GRID_ROWS by TERM_GRID_COLUMNS single
+// character cells, each showing a background colour. terminalio.c keeps a
+// copy of what every cell shows, so that only cells that change are sent.
+#define TERM_GRID_ROWS 8
+#define TERM_GRID_COLUMNS 16
+
+/// <summary>
+/// Places the grid on the terminal. Must be called before the other grid
+/// functions are used.
+/// </summary>
+/// <param name="row">The terminal row of the top row of the grid.</param>
+/// <param name="col">The terminal column of the left column of the
+/// grid.</param>
+void terminal_grid_init(uint8_t row, uint8_t col);
+
+/// <summary>
+/// Sets the background colour of a grid cell, to be sent by the next
+/// terminal_grid_flush(). Nothing is sent if the cell already shows the
+/// colour.
+/// </summary>
+/// <param name="row">The grid row of the cell, 0 being the top row.</param>
+/// <param name="col">The grid column of the cell.</param>
+/// <param name="background">BG_BLACK to BG_WHITE, or TERM_RESET for the
+/// default background.</param>
+void terminal_grid_set_cell(uint8_t row, uint8_t col,
+	DisplayParameter background);
+
+/// <summary>
+/// Sends the grid cells changed since the last flush. Changes on a row are
+/// sent as one run after a single cursor move when reprinting the cells
+/// between them is shorter than moving the cursor past them. No run is
+/// started once the byte budget has been used, except the first, and the
+/// changes not sent are left for the next flush.
+/// </summary>
+/// <param name="byte_budget">The number of bytes to send, or UINT16_MAX
+/// to send everything.</param>
+/// <returns>Whether every change was sent.</returns>
+bool terminal_grid_flush(uint16_t byte_budget);
+
 #endif /* TERMINAL_IO_H */
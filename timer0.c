@@ -6,8 +6,8 @@
 
 #include "timer0.h"
 #include <stdint.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
+#include "hal.h"
+#include "isrtrace.h"
 
 // Our internal clock tick count - incremented every millisecond. Will
 // overflow every ~49 days.
@@ -18,30 +18,10 @@ void init_timer0(void)
 	// Reset clock tick count. L indicates a long (32 bit) constant.
 	clock_ticks_ms = 0L;
 
-	// Set up timer 0 to generate an interrupt every 1ms. We will divide
-	// the clock by 64 and count up to 124. We will therefore get an
-	// interrupt every 64 x 125 clock cycles, i.e. every 1 milliseconds
-	// with an 8MHz clock. The counter will be reset to 0 when it reaches
-	// it's output compare value.
-
-	// Clear the timer.
-	TCNT0 = 0;
-
-	// Set the output compare value to be 124.
-	OCR0A = 124;
-
-	// Set the timer to clear on compare match (CTC mode) and to
-	// divide the clock by 64. This starts the timer running.
-	TCCR0A = (1 << WGM01);
-	TCCR0B = (1 << CS01) | (1 << CS00);
-
-	// Enable an interrupt on output compare match. Note that
-	// interrupts have to be enabled globally before the interrupts
-	// will fire.
-	TIMSK0 |= (1 << OCIE0A);
-
-	// Make sure the interrupt flag is cleared by writing a 1 to it.
-	TIFR0 = (1 << OCF0A);
+	// Set up timer 0 to generate an interrupt every 1ms (CTC mode, the
+	// clock divided by 64, counting up to 124). Note that interrupts have
+	// to be enabled globally before the interrupts will fire.
+	hal_tick_init();
 }
 
 uint32_t get_current_time(void)
@@ -49,7 +29,7 @@ uint32_t get_current_time(void)
 	// Disable interrupts so we can be sure that the interrupt doesn't
 	// fire when we've copied just a couple of bytes of the value.
 	// Interrupts are re-enabled if they were enabled at the start.
-	uint8_t interrupts_were_enabled = bit_is_set(SREG, SREG_I);
+	uint8_t interrupts_were_enabled = hal_interrupts_enabled();
 	cli();
 	uint32_t result = clock_ticks_ms;
 	if (interrupts_were_enabled)
@@ -62,6 +42,8 @@ uint32_t get_current_time(void)
 // Interrupt handler for clock tick.
 ISR(TIMER0_COMPA_vect)
 {
+	ISR_TRACE_ENTER(ISR_TRACE_TIMER0);
 	// Increment our clock tick count.
 	clock_ticks_ms++;
+	ISR_TRACE_EXIT(ISR_TRACE_TIMER0);
 }
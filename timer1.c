@@ -5,8 +5,8 @@
  */
 
 #include "timer1.h"
-#include <avr/io.h>
-#include <avr/interrupt.h>
+#include "hal.h"
+#include "isrtrace.h"
 #include "game.h"
 uint8_t music_duration = 0;
 bool game_muted;
@@ -25,32 +25,23 @@ uint16_t duty_cycle_to_pulse_width(float dutycycle, uint16_t clockperiod) {
 void init_timer1(void)
 {
 
-	// Setup timer 1.
-	TCNT1 = 0;
+	// Setup timer 1. Clears the counter, enables the interrupt on output
+	// compare match and makes pin OC1B (port D, pin 4) an output.
+	hal_tone_init();
 	set_up_music(200,2);
-	// // /* Enable interrupt on timer on output compare match 
-	TIMSK1 = (1<<OCIE1A);
-
-	// // /* Ensure interrupt flag is cleared */
-	TIFR1 = (1<<OCF1A);
-
-	// Make pin OC1B be an output (port D, pin 4)
-	DDRD = (1<<4);
-	
 
 	// /* Set up timer/counter  so that it reaches an output compare
 	// ** match every 1 millisecond (1000 times per second) and then
 	// ** resets to 0.
 	// ** We divide the clock by 8 and count 1000 cycles (0 to 999)
-	OCR1A = 999;
+	hal_tone_set_top(999);
 	// 8,000,000/8 = number * 0.001 = 1000 - 1 = 999
 
 	// Set up timer/counter 1 for Fast PWM, counting from 0 to the value in OCR1A
 	// before reseting to 0. Count at 1MHz (CLK/8).
 	// Configure output OC1B to be clear on compare match and set on timer/counter
 	// overflow (non-inverting mode).
-	TCCR1A = (1 << COM1B1) | (0 <<COM1B0) | (1 <<WGM11) | (1 << WGM10);
-	TCCR1B = (1 << WGM13) | (1 << WGM12); // dont start the buzzer just yet otherwise as soon as power is plugged into the AVR it will play.
+	hal_tone_enable_pwm(); // dont start the buzzer just yet otherwise as soon as power is plugged into the AVR it will play.
 	// Sounds must be tones (not clicks) in the range 20Hz to 5kHz.
 	 
 	
@@ -63,26 +54,26 @@ void set_up_music(uint16_t freq, float dutycycle){
 	uint16_t pulsewidth = duty_cycle_to_pulse_width(dutycycle, clockperiod);
 
 	// Set the maximum count value for timer/counter 1 to be one less than the clockperiod
-	OCR1A = clockperiod - 1;
+	hal_tone_set_top(clockperiod - 1);
 	
 	// Set the count compare value based on the pulse width. The value will be 1 less
 	// than the pulse width - unless the pulse width is 0.
 	if(pulsewidth == 0) {
-		OCR1B = 0;
+		hal_tone_set_compare(0);
 	} else {
-		OCR1B = pulsewidth - 1;
+		hal_tone_set_compare(pulsewidth - 1);
 	}
 }
 
 void start_tone(){
-	TCCR1B |= (0 << CS12) | (1 << CS11) | (0 << CS10);
+	hal_tone_start();
 }
 
 void stop_tone(){
 	// it makes those bits not, so the inverse and then
 	//  bit mask AND to still have WGM bits but no CS bits for no clock source
 	// so that it turns off.
-	TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10)); // ~(0b00000111) => 0b11111000
+	hal_tone_stop(); // ~(0b00000111) => 0b11111000
 }
 
 void generate_music(int type_of_music){
@@ -119,6 +110,7 @@ void generate_music(int type_of_music){
 }
 
 ISR(TIMER1_COMPA_vect){
+	ISR_TRACE_ENTER(ISR_TRACE_TIMER1);
 	// printf(("inTERRUPT......"));
 	// Timer/counter 1 compare match A interrupt service routine
 	// I think compare match happens every millisecond
@@ -132,5 +124,6 @@ ISR(TIMER1_COMPA_vect){
 		stop_tone();
 		// TIMSK1 &= ~(1 << OCIE1A); // Disable interrupt
 	}
+	ISR_TRACE_EXIT(ISR_TRACE_TIMER1);
 }
 
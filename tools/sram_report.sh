@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# sram_report.sh
+#
+# Author: Jevi Waugh
+#
+# Build-time SRAM budget report. Lists every symbol in the .data and .bss
+# sections of a linked ELF, largest first, followed by the section totals
+# and the SRAM left over for the stack. Compare the headroom with the
+# deepest stack reported at run time by the 'I' debug key (see
+# hal_sram_unused_bytes() in hal.h).
+#
+# Usage:
+#
+#   make sram_report
+#
+# or, on any linked ELF:
+#
+#   tools/sram_report.sh build/sokoban.elf
+#
+# NM selects the nm program (default avr-nm) and SRAM_BYTES the SRAM size
+# (default 2048, the ATmega324A). Constants that are not in PROGMEM are
+# read-only data, which the AVR linker places in .data (and therefore SRAM);
+# set RODATA_IN_SRAM=0 when reporting on a host build.
+
+set -e
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 <elf file>" >&2
+	exit 2
+fi
+
+NM=${NM:-avr-nm}
+SRAM_BYTES=${SRAM_BYTES:-2048}
+RODATA_IN_SRAM=${RODATA_IN_SRAM:-1}
+
+"$NM" --print-size --size-sort --radix=d "$1" | awk -v sram="$SRAM_BYTES" \
+	-v types="$([ "$RODATA_IN_SRAM" = 0 ] && echo '^[dDbB]$' || echo '^[dDrRbB]$')" '
+	# Lines are "<address> <size> <type> <name>". Types d/D (and r/R,
+	# read-only data) are .data, b/B are .bss.
+	NF == 4 && $3 ~ types {
+		size = $2 + 0
+		section = ($3 ~ /[bB]/) ? ".bss" : ".data"
+		total[section] += size
+		line[n++] = sprintf("%6d  %-5s  %s", size, section, $4)
+	}
+	END {
+		printf("%6s  %-5s  %s\n", "bytes", "sect", "symbol")
+		# nm sorted smallest first, print largest first.
+		for (i = n - 1; i >= 0; i--)
+		{
+			print line[i]
+		}
+		used = total[".data"] + total[".bss"]
+		printf("\n%6d  .data\n%6d  .bss\n%6d  static total\n",
+			total[".data"], total[".bss"], used)
+		printf("%6d  left for the stack (of %d)\n", sram - used, sram)
+	}'
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# title_spans.py
+#
+# Author: Jevi Waugh
+#
+# Generates the title_spans table in startscrn.c, the terminal title art as
+# runs of cells of the same colour, from the art as a bitmap and the columns
+# at which its colour changes. To change the art, edit TITLE and COLOURS
+# below and replace the body of the table with the output of
+#
+#   tools/title_spans.py
+#
+
+import sys
+
+# The art, 64 columns wide, one string per line. A '1' is a coloured cell.
+TITLE = [
+	"1111111001111110011000110011111100111111000111110011100001100000",
+	"1100000011000011011001100110000110110001101100011011110001100000",
+	"1111111011000011011111000110000110111111001111111011011001100000",
+	"0000011011000011011001100110000110110001101100011011001101100000",
+	"1111111001111110011000110011111100111111001100011011000111100000",
+]
+
+# The colour of each cell is that of the first of these, from the left, that
+# ends at or after its column: (last column, run macro in startscrn.c).
+COLOURS = [
+	(6, "M"),
+	(15, "G"),
+	(23, "B"),
+	(32, "Y"),
+	(40, "R"),
+	(48, "W"),
+	(58, "C"),
+]
+
+# As the rest of the table: a tab indent, and lines of at most 80 columns
+# with a tab counted as 4.
+INDENT = "\t"
+INDENT_WIDTH = 4
+LINE_WIDTH = 80
+
+
+def colour(line, col):
+	if TITLE[line][col] != "1":
+		return "_"
+	for last, macro in COLOURS:
+		if col <= last:
+			return macro
+	sys.exit("line %d, column %d has no colour" % (line, col))
+
+
+def spans(line):
+	# The blank cells at the end of the line are left out.
+	cells = [colour(line, col) for col in range(len(TITLE[line].rstrip("0")))]
+	runs = []
+	for cell in cells:
+		if runs and runs[-1][0] == cell:
+			runs[-1][1] += 1
+		else:
+			runs.append([cell, 1])
+	return ["%s(%d)" % (macro, length) for macro, length in runs] + ["END"]
+
+
+def main():
+	for line in range(len(TITLE)):
+		text = ""
+		for item in spans(line):
+			if text and INDENT_WIDTH + len(text) + len(item) + 2 > LINE_WIDTH:
+				print(INDENT + text.rstrip())
+				text = ""
+			text += item + ", "
+		print(INDENT + text.rstrip())
+
+
+if __name__ == "__main__":
+	main()